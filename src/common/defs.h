@@ -23,6 +23,7 @@
 
 constexpr const char* config_name = "gummyconf";
 constexpr const char* fifo_name   = "/tmp/gummy.fifo";
+constexpr const char* status_fifo_name = "/tmp/gummy.status.fifo"; // daemon to client
 constexpr const char* lock_name   = "/tmp/gummy.lock";
 
 constexpr int brt_steps_max  = 500;
@@ -81,4 +82,25 @@ constexpr std::array<double, 46 * 3> ingo_thies_table {
     1.00000000,  1.00000000,  1.00000000 // 6500K - 137
 };
 
+/**
+ * RGB multipliers of each temperature step, from temp_k_min at step 0
+ * to temp_k_max at temp_steps_max, interpolated between the two closest
+ * 100K rows of the table above. */
+constexpr std::array<std::array<double, 3>, temp_steps_max + 1> temp_step_table = [] {
+	std::array<std::array<double, 3>, temp_steps_max + 1> ret {};
+	for (int step = 0; step <= temp_steps_max; ++step) {
+		const double k   = temp_k_min + double(temp_k_max - temp_k_min) * step / temp_steps_max;
+		const double row = (k - 2000) / 100;
+		const int    r0  = int(row) < 44 ? int(row) : 44;
+		const double t   = row - r0;
+		for (int ch = 0; ch < 3; ++ch) {
+			const double a = ingo_thies_table[r0 * 3 + ch];
+			const double b = ingo_thies_table[(r0 + 1) * 3 + ch];
+			ret[step][ch] = a + t * (b - a);
+		}
+	}
+	return ret;
+}();
+static_assert(temp_step_table[0][2] == 1.0 && temp_step_table[temp_steps_max][2] == ingo_thies_table[2]);
+
 #endif // DEFS_H
@@ -21,17 +21,1070 @@
 
 #include <fcntl.h>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
-int calc_brightness(uint8_t *buf, uint64_t buf_sz, int bytes_per_pixel, int stride)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Channel sum kernels. Each one adds up the R/G/B bytes of every pixel found
+ * at `inc` bytes from the previous one in a BGRX buffer. The sums are exact
+ * integers, so all kernels return the same result as the scalar one. */
+using Rgb_sum_fn = void (*)(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3]);
+
+using Rgb_sum_at_fn = void (*)(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3]);
+
+static void rgb_sum_scalar(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
 {
-	uint64_t rgb[3] {};
-	for (uint64_t i = 0, inc = stride * bytes_per_pixel; i < buf_sz; i += inc) {
+	for (uint64_t i = 0; i < buf_sz; i += inc) {
 		rgb[0] += buf[i + 2];
 		rgb[1] += buf[i + 1];
 		rgb[2] += buf[i];
 	}
+}
+
+static void rgb_sum_at_scalar(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3])
+{
+	for (size_t i = 0; i < n; ++i) {
+		rgb[0] += buf[offsets[i] + 2];
+		rgb[1] += buf[offsets[i] + 1];
+		rgb[2] += buf[offsets[i]];
+	}
+}
+
+/**
+ * sRGB to linear light, in 1/65535ths. The transfer function raises to the
+ * 2.4th power, which isn't constexpr: x^2.4 = x^2 * (x^2)^(1/5), and the
+ * fifth root is found with Newton's method. Starting from 1, it converges
+ * from above for every x in (0, 1]. */
+constexpr double fifth_root(double x)
+{
+	double r = 1;
+	for (int i = 0; i < 32; ++i)
+		r -= (r * r * r * r * r - x) / (5 * r * r * r * r);
+	return r;
+}
+
+constexpr uint32_t srgb_to_linear(int c)
+{
+	const double x = c / 255.;
+	if (x <= 0.04045)
+		return uint32_t(x / 12.92 * 65535 + 0.5);
+	const double b = (x + 0.055) / 1.055;
+	return uint32_t(b * b * fifth_root(b * b) * 65535 + 0.5);
+}
+
+struct Srgb_lut
+{
+	uint32_t v[256];
+};
+
+constexpr Srgb_lut srgb_lut_init()
+{
+	Srgb_lut l {};
+	for (int i = 0; i < 256; ++i)
+		l.v[i] = srgb_to_linear(i);
+	return l;
+}
+
+static constexpr Srgb_lut srgb_lut = srgb_lut_init();
+static_assert(srgb_lut.v[0] == 0 && srgb_lut.v[255] == 65535);
+
+static void rgb_sum_lin_scalar(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
+{
+	for (uint64_t i = 0; i < buf_sz; i += inc) {
+		rgb[0] += srgb_lut.v[buf[i + 2]];
+		rgb[1] += srgb_lut.v[buf[i + 1]];
+		rgb[2] += srgb_lut.v[buf[i]];
+	}
+}
+
+static void rgb_sum_at_lin_scalar(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3])
+{
+	for (size_t i = 0; i < n; ++i) {
+		rgb[0] += srgb_lut.v[buf[offsets[i] + 2]];
+		rgb[1] += srgb_lut.v[buf[offsets[i] + 1]];
+		rgb[2] += srgb_lut.v[buf[offsets[i]]];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * The vector kernels mask one channel out of each 32-bit pixel, then
+ * _mm_sad_epu8 against zero adds the remaining bytes into 64-bit lanes,
+ * which can't overflow. The scalar kernel takes care of the tail. */
+__attribute__((target("sse2")))
+static void rgb_sum_sse2(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
+{
+	const __m128i zero   = _mm_setzero_si128();
+	const __m128i r_mask = _mm_set1_epi32(0x00ff0000);
+	const __m128i g_mask = _mm_set1_epi32(0x0000ff00);
+	const __m128i b_mask = _mm_set1_epi32(0x000000ff);
+	__m128i r = zero, g = zero, b = zero;
+
+	uint64_t i = 0;
+	for (; i + 3 * inc + 4 <= buf_sz; i += 4 * inc) {
+		__m128i px;
+		if (inc == 4) {
+			px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+		} else {
+			int32_t p[4];
+			for (int j = 0; j < 4; ++j)
+				std::memcpy(&p[j], buf + i + j * inc, 4);
+			px = _mm_set_epi32(p[3], p[2], p[1], p[0]);
+		}
+		r = _mm_add_epi64(r, _mm_sad_epu8(_mm_and_si128(px, r_mask), zero));
+		g = _mm_add_epi64(g, _mm_sad_epu8(_mm_and_si128(px, g_mask), zero));
+		b = _mm_add_epi64(b, _mm_sad_epu8(_mm_and_si128(px, b_mask), zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), r);
+	rgb[0] += lanes[0] + lanes[1];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), g);
+	rgb[1] += lanes[0] + lanes[1];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), b);
+	rgb[2] += lanes[0] + lanes[1];
+
+	if (i < buf_sz)
+		rgb_sum_scalar(buf + i, buf_sz - i, inc, rgb);
+}
+
+__attribute__((target("avx2")))
+static void rgb_sum_avx2(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
+{
+	// gather offsets are 32-bit
+	if (inc > INT32_MAX / 8)
+		return rgb_sum_scalar(buf, buf_sz, inc, rgb);
+
+	const __m256i zero   = _mm256_setzero_si256();
+	const __m256i r_mask = _mm256_set1_epi32(0x00ff0000);
+	const __m256i g_mask = _mm256_set1_epi32(0x0000ff00);
+	const __m256i b_mask = _mm256_set1_epi32(0x000000ff);
+	const int s = int(inc);
+	const __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+	__m256i r = zero, g = zero, b = zero;
+
+	uint64_t i = 0;
+	for (; i + 7 * inc + 4 <= buf_sz; i += 8 * inc) {
+		const __m256i px = inc == 4
+		    ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i))
+		    : _mm256_i32gather_epi32(reinterpret_cast<const int*>(buf + i), offsets, 1);
+		r = _mm256_add_epi64(r, _mm256_sad_epu8(_mm256_and_si256(px, r_mask), zero));
+		g = _mm256_add_epi64(g, _mm256_sad_epu8(_mm256_and_si256(px, g_mask), zero));
+		b = _mm256_add_epi64(b, _mm256_sad_epu8(_mm256_and_si256(px, b_mask), zero));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), r);
+	rgb[0] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), g);
+	rgb[1] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), b);
+	rgb[2] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	if (i < buf_sz)
+		rgb_sum_scalar(buf + i, buf_sz - i, inc, rgb);
+}
+
+__attribute__((target("avx2")))
+static void rgb_sum_at_avx2(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3])
+{
+	const __m256i zero   = _mm256_setzero_si256();
+	const __m256i r_mask = _mm256_set1_epi32(0x00ff0000);
+	const __m256i g_mask = _mm256_set1_epi32(0x0000ff00);
+	const __m256i b_mask = _mm256_set1_epi32(0x000000ff);
+	__m256i r = zero, g = zero, b = zero;
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets + i));
+		const __m256i px  = _mm256_i32gather_epi32(reinterpret_cast<const int*>(buf), idx, 1);
+		r = _mm256_add_epi64(r, _mm256_sad_epu8(_mm256_and_si256(px, r_mask), zero));
+		g = _mm256_add_epi64(g, _mm256_sad_epu8(_mm256_and_si256(px, g_mask), zero));
+		b = _mm256_add_epi64(b, _mm256_sad_epu8(_mm256_and_si256(px, b_mask), zero));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), r);
+	rgb[0] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), g);
+	rgb[1] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), b);
+	rgb[2] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	rgb_sum_at_scalar(buf, offsets + i, n - i, rgb);
+}
+
+/**
+ * The linear light kernels look each channel up in the table with a gather.
+ * Table entries are 16-bit, so the 32-bit lanes are flushed to the
+ * 64-bit sums every lin_block iterations, before they can overflow. */
+constexpr int lin_block = 65536;
+
+__attribute__((target("avx2")))
+static inline void lin_gather(__m256i px, __m256i &r, __m256i &g, __m256i &b)
+{
+	const __m256i byte = _mm256_set1_epi32(0xff);
+	const int *lut = reinterpret_cast<const int*>(srgb_lut.v);
+	r = _mm256_add_epi32(r, _mm256_i32gather_epi32(lut, _mm256_and_si256(_mm256_srli_epi32(px, 16), byte), 4));
+	g = _mm256_add_epi32(g, _mm256_i32gather_epi32(lut, _mm256_and_si256(_mm256_srli_epi32(px, 8), byte), 4));
+	b = _mm256_add_epi32(b, _mm256_i32gather_epi32(lut, _mm256_and_si256(px, byte), 4));
+}
+
+__attribute__((target("avx2")))
+static inline void lin_flush(__m256i r, __m256i g, __m256i b, uint64_t rgb[3])
+{
+	uint32_t lanes[3][8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[0]), r);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[1]), g);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[2]), b);
+	for (int c = 0; c < 3; ++c)
+		for (int j = 0; j < 8; ++j)
+			rgb[c] += lanes[c][j];
+}
+
+__attribute__((target("avx2")))
+static void rgb_sum_lin_avx2(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
+{
+	if (inc > INT32_MAX / 8)
+		return rgb_sum_lin_scalar(buf, buf_sz, inc, rgb);
+
+	const int s = int(inc);
+	const __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+
+	uint64_t i = 0;
+	while (i + 7 * inc + 4 <= buf_sz) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		for (int k = 0; k < lin_block && i + 7 * inc + 4 <= buf_sz; ++k, i += 8 * inc) {
+			const __m256i px = inc == 4
+			    ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i))
+			    : _mm256_i32gather_epi32(reinterpret_cast<const int*>(buf + i), offsets, 1);
+			lin_gather(px, r, g, b);
+		}
+		lin_flush(r, g, b, rgb);
+	}
+
+	if (i < buf_sz)
+		rgb_sum_lin_scalar(buf + i, buf_sz - i, inc, rgb);
+}
+
+__attribute__((target("avx2")))
+static void rgb_sum_at_lin_avx2(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3])
+{
+	size_t i = 0;
+	while (i + 8 <= n) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		for (int k = 0; k < lin_block && i + 8 <= n; ++k, i += 8) {
+			const __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets + i));
+			lin_gather(_mm256_i32gather_epi32(reinterpret_cast<const int*>(buf), idx, 1), r, g, b);
+		}
+		lin_flush(r, g, b, rgb);
+	}
+
+	rgb_sum_at_lin_scalar(buf, offsets + i, n - i, rgb);
+}
+#endif
+
+static Rgb_sum_fn rgb_sum_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_sum_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return rgb_sum_sse2;
+#endif
+	return rgb_sum_scalar;
+}
+
+static Rgb_sum_at_fn rgb_sum_at_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_sum_at_avx2;
+#endif
+	return rgb_sum_at_scalar;
+}
+
+static Rgb_sum_fn rgb_sum_lin_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_sum_lin_avx2;
+#endif
+	return rgb_sum_lin_scalar;
+}
+
+static Rgb_sum_at_fn rgb_sum_at_lin_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_sum_at_lin_avx2;
+#endif
+	return rgb_sum_at_lin_scalar;
+}
+
+// Picked once at startup
+static const Rgb_sum_fn    rgb_sum_vec        = rgb_sum_select();
+static const Rgb_sum_at_fn rgb_sum_at_vec     = rgb_sum_at_select();
+static const Rgb_sum_fn    rgb_sum_lin_vec    = rgb_sum_lin_select();
+static const Rgb_sum_at_fn rgb_sum_at_lin_vec = rgb_sum_at_lin_select();
+
+/**
+ * Kernels for the other pixel formats. Everything about the format is a
+ * template parameter, so each instance is a branch-free loop. Raw channel
+ * values are summed, and scaled to 8 bits once by calc_brightness().
+ * Linear light ones are scaled to 8 bits first, to index the table. */
+constexpr int mask_shift(uint32_t mask)
+{
+	int s = 0;
+	while (mask && !(mask & 1)) {
+		mask >>= 1;
+		++s;
+	}
+	return s;
+}
+
+template <int Bpp, bool Msb>
+static inline uint32_t load_px(const uint8_t *p)
+{
+	uint32_t px = 0;
+	for (int i = 0; i < Bpp; ++i)
+		px |= uint32_t(p[i]) << (8 * (Msb ? Bpp - 1 - i : i));
+	return px;
+}
+
+template <uint32_t Mask>
+static inline uint32_t to_8bit(uint32_t px)
+{
+	constexpr uint32_t max = Mask >> mask_shift(Mask);
+	const uint32_t v = (px & Mask) >> mask_shift(Mask);
+	if constexpr (max == 255)
+		return v;
+	else
+		return (v * 255 + max / 2) / max;
+}
+
+template <uint32_t Mask, bool Lin>
+static inline uint32_t channel(uint32_t px)
+{
+	if constexpr (Lin)
+		return srgb_lut.v[to_8bit<Mask>(px)];
+	else
+		return (px & Mask) >> mask_shift(Mask);
+}
+
+/**
+ * Histogram bin of the luma of a pixel, from its 8-bit channels. The weights
+ * are the Rec. 709 ones in 1/256ths, so the luma fits in 16 bits. */
+static_assert(hist_bins == 64);
+constexpr uint32_t luma_bin(uint32_t r, uint32_t g, uint32_t b)
+{
+	return (54 * r + 183 * g + 19 * b) >> 10;
+}
+
+template <uint32_t R, uint32_t G, uint32_t B, bool Lin, bool Hist>
+static inline void add_px(uint32_t px, uint64_t rgb[3], uint32_t *hist)
+{
+	rgb[0] += channel<R, Lin>(px);
+	rgb[1] += channel<G, Lin>(px);
+	rgb[2] += channel<B, Lin>(px);
+	if constexpr (Hist)
+		++hist[luma_bin(to_8bit<R>(px), to_8bit<G>(px), to_8bit<B>(px))];
+}
+
+template <int Bpp, uint32_t R, uint32_t G, uint32_t B, bool Msb, bool Lin>
+static void rgb_sum_fmt(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3])
+{
+	for (uint64_t i = 0; i + Bpp <= buf_sz; i += inc)
+		add_px<R, G, B, Lin, false>(load_px<Bpp, Msb>(buf + i), rgb, nullptr);
+}
+
+template <int Bpp, uint32_t R, uint32_t G, uint32_t B, bool Msb, bool Lin>
+static void rgb_sum_at_fmt(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3])
+{
+	for (size_t i = 0; i < n; ++i)
+		add_px<R, G, B, Lin, false>(load_px<Bpp, Msb>(buf + offsets[i]), rgb, nullptr);
+}
+
+template <int Bpp, uint32_t R, uint32_t G, uint32_t B, bool Msb, bool Lin>
+static void rgb_hist_fmt(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	for (uint64_t i = 0; i + Bpp <= buf_sz; i += inc)
+		add_px<R, G, B, Lin, true>(load_px<Bpp, Msb>(buf + i), rgb, hist);
+}
+
+template <int Bpp, uint32_t R, uint32_t G, uint32_t B, bool Msb, bool Lin>
+static void rgb_hist_at_fmt(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	for (size_t i = 0; i < n; ++i)
+		add_px<R, G, B, Lin, true>(load_px<Bpp, Msb>(buf + offsets[i]), rgb, hist);
+}
+
+using Rgb_hist_fn = void (*)(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3], uint32_t hist[hist_bins]);
+
+using Rgb_hist_at_fn = void (*)(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3], uint32_t hist[hist_bins]);
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Vector histogram kernels for BGRX. The luma of 8 pixels is computed at
+ * once with 16-bit multiplies, then the bins are incremented one by one,
+ * alternating between 4 histograms so that consecutive increments of the
+ * same bin don't wait on each other. Channel sums use 32-bit lanes,
+ * flushed every lin_block iterations like the linear light kernels. */
+template <bool Lin>
+__attribute__((target("avx2")))
+static inline void hist_px(__m256i px, __m256i &r, __m256i &g, __m256i &b, uint32_t sub[4][hist_bins])
+{
+	const __m256i byte = _mm256_set1_epi32(0xff);
+	const __m256i r8 = _mm256_and_si256(_mm256_srli_epi32(px, 16), byte);
+	const __m256i g8 = _mm256_and_si256(_mm256_srli_epi32(px, 8), byte);
+	const __m256i b8 = _mm256_and_si256(px, byte);
+	const __m256i y  = _mm256_add_epi32(_mm256_add_epi32(
+	    _mm256_mullo_epi16(r8, _mm256_set1_epi32(54)),
+	    _mm256_mullo_epi16(g8, _mm256_set1_epi32(183))),
+	    _mm256_mullo_epi16(b8, _mm256_set1_epi32(19)));
+
+	alignas(32) uint32_t bins[8];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(bins), _mm256_srli_epi32(y, 10));
+	for (int j = 0; j < 8; ++j)
+		++sub[j & 3][bins[j]];
+
+	if constexpr (Lin) {
+		const int *lut = reinterpret_cast<const int*>(srgb_lut.v);
+		r = _mm256_add_epi32(r, _mm256_i32gather_epi32(lut, r8, 4));
+		g = _mm256_add_epi32(g, _mm256_i32gather_epi32(lut, g8, 4));
+		b = _mm256_add_epi32(b, _mm256_i32gather_epi32(lut, b8, 4));
+	} else {
+		r = _mm256_add_epi32(r, r8);
+		g = _mm256_add_epi32(g, g8);
+		b = _mm256_add_epi32(b, b8);
+	}
+}
+
+static void hist_merge(const uint32_t sub[4][hist_bins], uint32_t hist[hist_bins])
+{
+	for (int j = 0; j < 4; ++j)
+		for (int i = 0; i < hist_bins; ++i)
+			hist[i] += sub[j][i];
+}
+
+template <bool Lin>
+__attribute__((target("avx2")))
+static void rgb_hist_avx2(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	if (inc > INT32_MAX / 8)
+		return rgb_hist_fmt<4, 0x00ff0000, 0x0000ff00, 0x000000ff, false, Lin>(buf, buf_sz, inc, rgb, hist);
+
+	const int s = int(inc);
+	const __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+	uint32_t sub[4][hist_bins] {};
+
+	uint64_t i = 0;
+	while (i + 7 * inc + 4 <= buf_sz) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		for (int k = 0; k < lin_block && i + 7 * inc + 4 <= buf_sz; ++k, i += 8 * inc) {
+			const __m256i px = inc == 4
+			    ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i))
+			    : _mm256_i32gather_epi32(reinterpret_cast<const int*>(buf + i), offsets, 1);
+			hist_px<Lin>(px, r, g, b, sub);
+		}
+		lin_flush(r, g, b, rgb);
+	}
+	hist_merge(sub, hist);
+
+	if (i < buf_sz)
+		rgb_hist_fmt<4, 0x00ff0000, 0x0000ff00, 0x000000ff, false, Lin>(buf + i, buf_sz - i, inc, rgb, hist);
+}
+
+template <bool Lin>
+__attribute__((target("avx2")))
+static void rgb_hist_at_avx2(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	uint32_t sub[4][hist_bins] {};
+
+	size_t i = 0;
+	while (i + 8 <= n) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		for (int k = 0; k < lin_block && i + 8 <= n; ++k, i += 8) {
+			const __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets + i));
+			hist_px<Lin>(_mm256_i32gather_epi32(reinterpret_cast<const int*>(buf), idx, 1), r, g, b, sub);
+		}
+		lin_flush(r, g, b, rgb);
+	}
+	hist_merge(sub, hist);
+
+	rgb_hist_at_fmt<4, 0x00ff0000, 0x0000ff00, 0x000000ff, false, Lin>(buf, offsets + i, n - i, rgb, hist);
+}
+#endif
+
+template <bool Lin>
+static Rgb_hist_fn rgb_hist_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_hist_avx2<Lin>;
+#endif
+	return rgb_hist_fmt<4, 0x00ff0000, 0x0000ff00, 0x000000ff, false, Lin>;
+}
+
+template <bool Lin>
+static Rgb_hist_at_fn rgb_hist_at_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rgb_hist_at_avx2<Lin>;
+#endif
+	return rgb_hist_at_fmt<4, 0x00ff0000, 0x0000ff00, 0x000000ff, false, Lin>;
+}
+
+// [linear light]
+static const Rgb_hist_fn    rgb_hist_vec[2]    { rgb_hist_select<false>(), rgb_hist_select<true>() };
+static const Rgb_hist_at_fn rgb_hist_at_vec[2] { rgb_hist_at_select<false>(), rgb_hist_at_select<true>() };
+
+struct Format_kernels
+{
+	int bytes_per_pixel;
+	uint32_t masks[3];
+	bool msb_first;
+	// [linear light]
+	Rgb_sum_fn sum[2];
+	Rgb_sum_at_fn sum_at[2];
+	Rgb_hist_fn hist[2];
+	Rgb_hist_at_fn hist_at[2];
+};
+
+template <int Bpp, uint32_t R, uint32_t G, uint32_t B, bool Msb>
+constexpr Format_kernels format_kernels()
+{
+	return { Bpp, { R, G, B }, Msb,
+		{ rgb_sum_fmt<Bpp, R, G, B, Msb, false>,     rgb_sum_fmt<Bpp, R, G, B, Msb, true> },
+		{ rgb_sum_at_fmt<Bpp, R, G, B, Msb, false>,  rgb_sum_at_fmt<Bpp, R, G, B, Msb, true> },
+		{ rgb_hist_fmt<Bpp, R, G, B, Msb, false>,    rgb_hist_fmt<Bpp, R, G, B, Msb, true> },
+		{ rgb_hist_at_fmt<Bpp, R, G, B, Msb, false>, rgb_hist_at_fmt<Bpp, R, G, B, Msb, true> } };
+}
+
+static const Format_kernels known_formats[] {
+	format_kernels<4, 0x00ff0000, 0x0000ff00, 0x000000ff, true>(),  // xRGB8888
+	format_kernels<4, 0x000000ff, 0x0000ff00, 0x00ff0000, false>(), // xBGR8888
+	format_kernels<4, 0x000000ff, 0x0000ff00, 0x00ff0000, true>(),
+	format_kernels<4, 0x3ff00000, 0x000ffc00, 0x000003ff, false>(), // depth 30
+	format_kernels<4, 0x3ff00000, 0x000ffc00, 0x000003ff, true>(),
+	format_kernels<4, 0x000003ff, 0x000ffc00, 0x3ff00000, false>(),
+	format_kernels<4, 0x000003ff, 0x000ffc00, 0x3ff00000, true>(),
+	format_kernels<3, 0x00ff0000, 0x0000ff00, 0x000000ff, false>(), // packed 24
+	format_kernels<3, 0x00ff0000, 0x0000ff00, 0x000000ff, true>(),
+	format_kernels<2, 0x0000f800, 0x000007e0, 0x0000001f, false>(), // depth 16
+	format_kernels<2, 0x0000f800, 0x000007e0, 0x0000001f, true>(),
+	format_kernels<2, 0x00007c00, 0x000003e0, 0x0000001f, false>(), // depth 15
+	format_kernels<2, 0x00007c00, 0x000003e0, 0x0000001f, true>(),
+};
+
+Rgb_kernels rgb_kernels(const Pixel_format &f, Luma_mode luma)
+{
+	const bool lin = luma != LUMA_GAMMA;
+	Rgb_kernels k;
+	k.bytes_per_pixel = f.bytes_per_pixel;
+	k.luma = luma;
+	for (int i = 0; i < 3; ++i)
+		k.max[i] = lin ? 65535 : f.masks[i] >> mask_shift(f.masks[i]);
+
+	// BGRX, what virtually every X server uses, has the vector kernels
+	if (f.bytes_per_pixel == 4 && !f.msb_first
+	    && f.masks[0] == 0x00ff0000 && f.masks[1] == 0x0000ff00 && f.masks[2] == 0x000000ff) {
+		k.sum     = lin ? rgb_sum_lin_vec : rgb_sum_vec;
+		k.sum_at  = lin ? rgb_sum_at_lin_vec : rgb_sum_at_vec;
+		k.hist    = rgb_hist_vec[lin];
+		k.hist_at = rgb_hist_at_vec[lin];
+		return k;
+	}
+
+	for (const auto &fmt : known_formats) {
+		if (fmt.bytes_per_pixel == f.bytes_per_pixel
+		    && fmt.msb_first == f.msb_first
+		    && std::equal(fmt.masks, fmt.masks + 3, f.masks)) {
+			k.sum     = fmt.sum[lin];
+			k.sum_at  = fmt.sum_at[lin];
+			k.hist    = fmt.hist[lin];
+			k.hist_at = fmt.hist_at[lin];
+			return k;
+		}
+	}
+
+	Rgb_kernels none {};
+	none.luma = luma;
+	return none;
+}
+
+/**
+ * The standard error of a mean of n samples is sigma / sqrt(n), and
+ * a [0, 255] channel can't have a sigma higher than 127.5. Returns the n
+ * keeping the error within `err` levels about 95% of the time (2 sigmas).
+ * Stratified samples only do better than that. */
+size_t samples_for_error(double err)
+{
+	const double n = std::pow(2 * 127.5 / std::max(err, 0.1), 2);
+	return size_t(std::ceil(n));
+}
+
+/**
+ * 64-bit hash of a pixel every `inc` bytes, FNV-1a over whole pixels.
+ * Telling apart frames differing on a tiny area takes about as many
+ * pixels as the area is small. */
+uint64_t fingerprint(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, int bytes_per_pixel)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (uint64_t i = 0; i + bytes_per_pixel <= buf_sz; i += inc) {
+		uint32_t px = 0;
+		memcpy(&px, buf + i, bytes_per_pixel);
+		h = (h ^ px) * 0x100000001b3;
+	}
+	return h;
+}
+
+// Same, of the pixels at every `step`th offset
+uint64_t fingerprint(const uint8_t *buf, const uint32_t *offsets, size_t n, size_t step, int bytes_per_pixel)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < n; i += step) {
+		uint32_t px = 0;
+		memcpy(&px, buf + offsets[i], bytes_per_pixel);
+		h = (h ^ px) * 0x100000001b3;
+	}
+	return h;
+}
+
+/**
+ * Gamma ramp kernels. Entry i of each channel is floor(floor(i * brt) * mult),
+ * in fixed point. brt is Q16, with the running product in 32-bit lanes that
+ * can't overflow since i * brt stays below 65536. The channel multipliers are
+ * Q32, split in 16-bit halves so that every product is done with 16-bit
+ * multiplies: val * hi in full, plus the high half of val * lo. A multiplier
+ * of 1 doesn't fit, so that channel is the value itself.
+ * All kernels give the same result, within one LSB of the floating point one. */
+struct Ramp_fx
+{
+	uint32_t brt;
+	uint16_t hi[3], lo[3];
+	bool one[3];
+};
+
+using Ramp_fn = void (*)(uint16_t *ramps[3], int ramp_sz, const Ramp_fx &fx, int start);
+
+static void ramps_scalar(uint16_t *ramps[3], int ramp_sz, const Ramp_fx &fx, int start)
+{
+	for (int i = start; i < ramp_sz; ++i) {
+		const uint32_t val = (uint32_t(i) * fx.brt) >> 16;
+		for (int c = 0; c < 3; ++c)
+			ramps[c][i] = fx.one[c] ? uint16_t(val)
+			    : uint16_t((val * fx.hi[c] + ((val * fx.lo[c]) >> 16)) >> 16);
+	}
+}
 
-	return (rgb[0] * 0.2126 + rgb[1] * 0.7152 + rgb[2] * 0.0722) * stride / (buf_sz / bytes_per_pixel);
+#if defined(__x86_64__) || defined(__i386__)
+// High half of val * (hi << 16 | lo) >> 16, adding the carry of the low halves
+__attribute__((target("sse2")))
+static inline __m128i ramp_mul(__m128i val, uint16_t hi, uint16_t lo)
+{
+	const __m128i h  = _mm_set1_epi16(short(hi));
+	const __m128i ll = _mm_mullo_epi16(val, h);
+	const __m128i q  = _mm_mulhi_epu16(val, _mm_set1_epi16(short(lo)));
+	const __m128i no_carry = _mm_cmpeq_epi16(_mm_adds_epu16(ll, q), _mm_add_epi16(ll, q));
+	return _mm_add_epi16(_mm_mulhi_epu16(val, h), _mm_add_epi16(no_carry, _mm_set1_epi16(1)));
+}
+
+__attribute__((target("sse2")))
+static void ramps_sse2(uint16_t *ramps[3], int ramp_sz, const Ramp_fx &fx, int)
+{
+	const uint32_t b = fx.brt;
+	const __m128i step = _mm_set1_epi32(int(8 * b));
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i flip = _mm_set1_epi16(INT16_MIN);
+	__m128i lo = _mm_setr_epi32(0, int(b), int(2 * b), int(3 * b));
+	__m128i hi = _mm_add_epi32(lo, _mm_set1_epi32(int(4 * b)));
+
+	int i = 0;
+	for (; i + 8 <= ramp_sz; i += 8) {
+		// Biased to signed, so that packing doesn't saturate
+		const __m128i val = _mm_xor_si128(_mm_packs_epi32(
+		    _mm_srai_epi32(_mm_xor_si128(lo, bias), 16),
+		    _mm_srai_epi32(_mm_xor_si128(hi, bias), 16)), flip);
+		for (int c = 0; c < 3; ++c) {
+			const __m128i out = fx.one[c] ? val : ramp_mul(val, fx.hi[c], fx.lo[c]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(ramps[c] + i), out);
+		}
+		lo = _mm_add_epi32(lo, step);
+		hi = _mm_add_epi32(hi, step);
+	}
+
+	ramps_scalar(ramps, ramp_sz, fx, i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ramp_mul(__m256i val, uint16_t hi, uint16_t lo)
+{
+	const __m256i h  = _mm256_set1_epi16(short(hi));
+	const __m256i ll = _mm256_mullo_epi16(val, h);
+	const __m256i q  = _mm256_mulhi_epu16(val, _mm256_set1_epi16(short(lo)));
+	const __m256i no_carry = _mm256_cmpeq_epi16(_mm256_adds_epu16(ll, q), _mm256_add_epi16(ll, q));
+	return _mm256_add_epi16(_mm256_mulhi_epu16(val, h), _mm256_add_epi16(no_carry, _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2")))
+static void ramps_avx2(uint16_t *ramps[3], int ramp_sz, const Ramp_fx &fx, int)
+{
+	const uint32_t b = fx.brt;
+	const __m256i step = _mm256_set1_epi32(int(16 * b));
+	__m256i lo = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(int(b)));
+	__m256i hi = _mm256_add_epi32(lo, _mm256_set1_epi32(int(8 * b)));
+
+	int i = 0;
+	for (; i + 16 <= ramp_sz; i += 16) {
+		// Packing works on 128-bit halves, the permute puts entries back in order
+		const __m256i val = _mm256_permute4x64_epi64(_mm256_packus_epi32(
+		    _mm256_srli_epi32(lo, 16),
+		    _mm256_srli_epi32(hi, 16)), 0xd8);
+		for (int c = 0; c < 3; ++c) {
+			const __m256i out = fx.one[c] ? val : ramp_mul(val, fx.hi[c], fx.lo[c]);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(ramps[c] + i), out);
+		}
+		lo = _mm256_add_epi32(lo, step);
+		hi = _mm256_add_epi32(hi, step);
+	}
+
+	ramps_scalar(ramps, ramp_sz, fx, i);
+}
+#endif
+
+static Ramp_fn ramps_select()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ramps_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return ramps_sse2;
+#endif
+	return ramps_scalar;
+}
+
+static const Ramp_fn ramps_vec = ramps_select();
+
+// Null when the CPU can't run it
+static Ramp_fn ramps_kernel(Ramp_kernel kernel)
+{
+	switch (kernel) {
+	case RAMP_AUTO:
+		return ramps_vec;
+	case RAMP_SCALAR:
+		return ramps_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	case RAMP_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? ramps_sse2 : nullptr;
+	case RAMP_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? ramps_avx2 : nullptr;
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+/**
+ * Fills the ramps of `ramp_sz` entries, see the kernels above. Returns false,
+ * leaving them untouched, if the CPU can't run the kernel asked for. */
+bool gamma_ramps(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, double brt_mult, const double mult[3], Ramp_kernel kernel)
+{
+	const Ramp_fn fn = ramps_kernel(kernel);
+	if (!fn)
+		return false;
+	if (ramp_sz <= 0)
+		return true;
+	Ramp_fx fx;
+	// Largest that doesn't overflow on the last entry
+	const double brt_max = double(UINT32_MAX / uint32_t(std::max(ramp_sz - 1, 1)));
+	fx.brt = uint32_t(std::min(std::max(brt_mult, 0.) * 65536 + 0.5, brt_max));
+	for (int c = 0; c < 3; ++c) {
+		const double m = std::clamp(mult[c], 0., 1.) * 4294967296. + 0.5;
+		fx.one[c] = m >= 4294967296.;
+		fx.hi[c]  = fx.one[c] ? 0 : uint16_t(uint64_t(m) >> 16);
+		fx.lo[c]  = fx.one[c] ? 0 : uint16_t(uint64_t(m));
+	}
+	uint16_t *ramps[3] { r, g, b };
+	fn(ramps, ramp_sz, fx, 0);
+	return true;
+}
+
+static bool rect_contains(const Rect &r, int x, int y)
+{
+	return x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h;
+}
+
+bool Region::contains(int x, int y) const
+{
+	const auto in = [x, y] (const Rect &r) { return rect_contains(r, x, y); };
+	return (include.empty() || std::any_of(include.begin(), include.end(), in))
+	    && std::none_of(exclude.begin(), exclude.end(), in);
+}
+
+/**
+ * Runs of every `step`th row of `area` that are inside the region, so that
+ * it can be summed without testing rectangles for each pixel. */
+std::vector<Span> Region::spans(const Rect &area, int step) const
+{
+	std::vector<Span> ret;
+	std::vector<std::pair<int, int>> runs;
+	const int ax1 = area.x + area.w;
+
+	for (int y = area.y; y < area.y + area.h; y += step) {
+		runs.clear();
+		if (include.empty())
+			runs.emplace_back(area.x, ax1);
+		for (const Rect &r : include) {
+			if (y >= r.y && y < r.y + r.h)
+				runs.emplace_back(std::max(r.x, area.x), std::min(r.x + r.w, ax1));
+		}
+
+		// cut each exclude rectangle out of the runs, leaving up to two parts
+		for (const Rect &r : exclude) {
+			if (y < r.y || y >= r.y + r.h)
+				continue;
+			const size_t n = runs.size();
+			for (size_t i = 0; i < n; ++i) {
+				const auto [x0, x1] = runs[i];
+				if (r.x + r.w <= x0 || r.x >= x1)
+					continue;
+				runs[i] = { x0, std::min(x1, r.x) };
+				runs.emplace_back(std::max(x0, r.x + r.w), x1);
+			}
+		}
+
+		// include rectangles may overlap
+		std::sort(runs.begin(), runs.end());
+		for (const auto &[x0, x1] : runs) {
+			if (x0 >= x1)
+				continue;
+			if (!ret.empty() && ret.back().y == y && x0 <= ret.back().x1)
+				ret.back().x1 = std::max(ret.back().x1, x1);
+			else
+				ret.push_back({ y, x0, x1 });
+		}
+	}
+	return ret;
+}
+
+// Bounding box of the spans, empty without any
+Rect bounds(const std::vector<Span> &spans)
+{
+	if (spans.empty())
+		return { 0, 0, 0, 0 };
+	int x0 = spans[0].x0, x1 = spans[0].x1;
+	for (const Span &s : spans) {
+		x0 = std::min(x0, s.x0);
+		x1 = std::max(x1, s.x1);
+	}
+	return { x0, spans.front().y, x1 - x0, spans.back().y - spans.front().y + 1 };
+}
+
+Rect intersect(const Rect &a, const Rect &b)
+{
+	const int x0 = std::max(a.x, b.x);
+	const int y0 = std::max(a.y, b.y);
+	const int x1 = std::min(a.x + a.w, b.x + b.w);
+	const int y1 = std::min(a.y + a.h, b.y + b.h);
+	if (x0 >= x1 || y0 >= y1)
+		return { 0, 0, 0, 0 };
+	return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Non empty intersections of each rectangle with `area`
+std::vector<Rect> intersect(const std::vector<Rect> &rects, const Rect &area)
+{
+	std::vector<Rect> ret;
+	for (const Rect &r : rects) {
+		const Rect i = intersect(r, area);
+		if (i.w > 0 && i.h > 0)
+			ret.push_back(i);
+	}
+	return ret;
+}
+
+bool operator==(const Rect &a, const Rect &b)
+{
+	return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+/**
+ * The part of the region inside `area` as rectangles: rows cut the same
+ * way are grouped in bands, each run of a band being one rectangle. They
+ * don't overlap, and are sorted by y, then x. */
+std::vector<Rect> Region::rects(const Rect &area) const
+{
+	std::vector<Rect> ret;
+	std::vector<Span> prev;
+	size_t band = 0; // first rectangle of the current band
+	for (int y = area.y; y < area.y + area.h; ++y) {
+		std::vector<Span> row = spans({ area.x, y, area.w, 1 }, 1);
+		const bool same = !row.empty() && row.size() == prev.size()
+		    && std::equal(row.begin(), row.end(), prev.begin(), [] (const Span &a, const Span &b) {
+			return a.x0 == b.x0 && a.x1 == b.x1;
+		});
+		if (same) {
+			for (size_t i = band; i < ret.size(); ++i)
+				++ret[i].h;
+		} else {
+			band = ret.size();
+			for (const Span &s : row)
+				ret.push_back({ s.x0, y, s.x1 - s.x0, 1 });
+		}
+		prev = std::move(row);
+	}
+	return ret;
+}
+
+// Bounding box of the part of the region inside `area`
+Rect Region::bounds(const Rect &area) const
+{
+	return ::bounds(spans(area, 1));
+}
+
+// xorshift32, so sampling patterns are the same on every start
+struct Xorshift32
+{
+	uint32_t x;
+	int operator()(int range)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		return int(x % uint32_t(range));
+	}
+};
+
+/**
+ * Splits the `box` of an image in about n square cells, picking a random
+ * pixel in each (jittered stratified sampling). Unlike a constant stride,
+ * this can't keep landing on the same column of a panel, and covers the
+ * image evenly. Pixels outside the region are dropped, so there are more
+ * cells to begin with. The byte offsets are relative to the box, and
+ * sorted, so they're read in memory order. */
+std::vector<uint32_t> sample_offsets(const Rect &box, int pitch, int bytes_per_pixel, size_t n, uint32_t seed, const Region &region)
+{
+	uint64_t area = 0;
+	for (const Span &s : region.spans(box, 1))
+		area += s.x1 - s.x0;
+	if (area == 0)
+		return {};
+
+	const int w = box.w;
+	const int h = box.h;
+	n = n * (uint64_t(w) * h) / area;
+	n = std::clamp(n, size_t(1), size_t(w) * h);
+	const double cell = std::sqrt(double(w) * h / n);
+	const int cols    = std::max(int(w / cell), 1);
+	const int rows    = std::max(int(h / cell), 1);
+
+	Xorshift32 rand { seed | 1 };
+
+	std::vector<uint32_t> ret;
+	ret.reserve(size_t(cols) * rows);
+	for (int r = 0; r < rows; ++r) {
+		const int y0 = r * h / rows;
+		const int y1 = (r + 1) * h / rows;
+		for (int c = 0; c < cols; ++c) {
+			const int x0 = c * w / cols;
+			const int x1 = (c + 1) * w / cols;
+			const int px = x0 + rand(x1 - x0);
+			const int py = y0 + rand(y1 - y0);
+			if (region.contains(box.x + px, box.y + py))
+				ret.push_back(uint32_t(py) * pitch + uint32_t(px) * bytes_per_pixel);
+		}
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+/**
+ * Like Region::spans(area, step), one row every `step` rows read a pixel
+ * every `step` from x0, but the row of each band and the first pixel of
+ * each run are picked at random. A fixed grid keeps missing, or hitting,
+ * patterns aligned to it, such as lines every 64 pixels. */
+std::vector<Span> sample_spans(const Rect &area, int step, uint32_t seed, const Region &region)
+{
+	Xorshift32 rand { seed | 1 };
+
+	std::vector<Span> ret;
+	for (int y = area.y; y < area.y + area.h; y += step) {
+		const int row = y + rand(std::min(step, area.y + area.h - y));
+		for (const Span &s : region.spans({ area.x, row, area.w, 1 }, 1)) {
+			const int x0 = s.x0 + rand(step);
+			if (x0 < s.x1)
+				ret.push_back({ row, x0, s.x1 });
+		}
+	}
+	return ret;
+}
+
+// CIE 1976 lightness of a relative luminance, scaled to [0, 255]
+static double lstar(double y)
+{
+	const double l = y > 216. / 24389 ? 116 * std::cbrt(y) - 16 : y * 24389. / 27;
+	return l * 255 / 100;
+}
+
+/**
+ * Weights the mean of each channel with the Rec. 709 coefficients.
+ * Returns a [0, 255] value, so every luma mode maps to the
+ * same brightness range. */
+int calc_brightness(const uint64_t rgb[3], uint64_t samples, const Rgb_kernels &k)
+{
+	const double r = rgb[0] * 255. / k.max[0];
+	const double g = rgb[1] * 255. / k.max[1];
+	const double b = rgb[2] * 255. / k.max[2];
+	const double y = (r * 0.2126 + g * 0.7152 + b * 0.0722) / samples;
+
+	if (k.luma == LUMA_LSTAR)
+		return lstar(y / 255);
+	return y;
+}
+
+/**
+ * Median or 90th percentile of a luma histogram, interpolated within its
+ * bin. Bins hold the luma of the encoded values: converting the result
+ * gives the percentile in the other modes, as the conversion is monotonic. */
+int calc_brightness(const uint32_t hist[hist_bins], Luma_stat stat, const Rgb_kernels &k)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < hist_bins; ++i)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+
+	const double target = total * (stat == LUMA_P90 ? 0.9 : 0.5);
+	uint64_t below = 0;
+	int i = 0;
+	while (i < hist_bins - 1 && below + hist[i] < target)
+		below += hist[i++];
+
+	const double frac = hist[i] ? (target - below) / hist[i] : 0;
+	const double y    = std::min((i + frac) * 256 / hist_bins, 255.) / 255;
+
+	if (k.luma == LUMA_GAMMA)
+		return y * 255;
+
+	const double lin = y <= 0.04045 ? y / 12.92 : std::pow((y + 0.055) / 1.055, 2.4);
+	if (k.luma == LUMA_LSTAR)
+		return lstar(lin);
+	return lin * 255;
 }
 
 double lerp(double x, double a, double b)
@@ -49,11 +1102,6 @@ double remap(double x, double a, double b, double ay, double by)
 	return lerp(normalize(x, a, b), ay, by);
 }
 
-double step_to_kelvin(int step, size_t color_ch)
-{
-	return remap(step, 0, temp_steps_max, 1, ingo_thies_table[color_ch]);
-};
-
 Animation animation_init(int start, int end, int fps, int duration_ms)
 {
 	Animation a;
@@ -21,17 +21,103 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 int set_lock();
-int calc_brightness(uint8_t *buf,
-                    uint64_t buf_sz,
-                    int bytes_per_pixel = 4,
-                    int stride = 1024);
+size_t samples_for_error(double err);
+uint64_t fingerprint(const uint8_t *buf,
+                     uint64_t buf_sz,
+                     uint64_t inc,
+                     int bytes_per_pixel);
+uint64_t fingerprint(const uint8_t *buf,
+                     const uint32_t *offsets,
+                     size_t n,
+                     size_t step,
+                     int bytes_per_pixel);
+
+// Picked by the CPU, or forced for tests
+enum Ramp_kernel { RAMP_AUTO, RAMP_SCALAR, RAMP_SSE2, RAMP_AVX2 };
+bool gamma_ramps(uint16_t *r,
+                 uint16_t *g,
+                 uint16_t *b,
+                 int ramp_sz,
+                 double brt_mult,
+                 const double mult[3],
+                 Ramp_kernel = RAMP_AUTO);
+
+struct Rect
+{
+	int x, y, w, h;
+};
+
+// Run of pixels [x0, x1) of row y
+struct Span
+{
+	int y, x0, x1;
+};
+Rect bounds(const std::vector<Span>&);
+Rect intersect(const Rect&, const Rect&); // empty if w or h is 0
+std::vector<Rect> intersect(const std::vector<Rect>&, const Rect&);
+bool operator==(const Rect&, const Rect&);
+
+/**
+ * Part of a screen brightness is measured on: the union of the `include`
+ * rectangles, or the whole screen without any, minus the `exclude` ones. */
+struct Region
+{
+	std::vector<Rect> include;
+	std::vector<Rect> exclude;
+	bool contains(int x, int y) const;
+	std::vector<Span> spans(const Rect &area, int step) const;
+	Rect bounds(const Rect &area) const;
+	std::vector<Rect> rects(const Rect &area) const;
+};
+
+std::vector<uint32_t> sample_offsets(const Rect &box, int pitch, int bytes_per_pixel, size_t n, uint32_t seed, const Region&);
+std::vector<Span> sample_spans(const Rect &area, int step, uint32_t seed, const Region&);
+
+/**
+ * What the brightness of a capture is measured as:
+ * the luma of the encoded values, the relative luminance
+ * of the linear light ones, or its CIE L* lightness. */
+enum Luma_mode { LUMA_GAMMA, LUMA_LINEAR, LUMA_LSTAR };
+
+// Statistic of the luma of the sampled pixels brightness follows
+enum Luma_stat { LUMA_MEAN, LUMA_MEDIAN, LUMA_P90 };
+constexpr int hist_bins = 64;
+
+struct Pixel_format
+{
+	int bytes_per_pixel;
+	uint32_t masks[3]; // R, G, B
+	bool msb_first;
+};
+
+/**
+ * Channel sum kernels specialized for a pixel format.
+ * `sum` reads a pixel every `inc` bytes, `sum_at` at each offset.
+ * Sums are in raw channel values up to `max`, or
+ * in linear light ones unless `luma` is LUMA_GAMMA.
+ * The `hist` variants also add the luma of each pixel to a histogram,
+ * in the same pass. */
+struct Rgb_kernels
+{
+	void (*sum)(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3]);
+	void (*sum_at)(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3]);
+	void (*hist)(const uint8_t *buf, uint64_t buf_sz, uint64_t inc, uint64_t rgb[3], uint32_t hist[hist_bins]);
+	void (*hist_at)(const uint8_t *buf, const uint32_t *offsets, size_t n, uint64_t rgb[3], uint32_t hist[hist_bins]);
+	uint32_t max[3];
+	int bytes_per_pixel;
+	Luma_mode luma;
+};
+// Kernels are null for unsupported formats
+Rgb_kernels rgb_kernels(const Pixel_format&, Luma_mode = LUMA_GAMMA);
+int calc_brightness(const uint64_t rgb[3], uint64_t samples, const Rgb_kernels&);
+int calc_brightness(const uint32_t hist[hist_bins], Luma_stat, const Rgb_kernels&);
 
 double lerp(double x, double a, double b);
 double normalize(double x, double a, double b);
 double remap(double x, double a, double b, double ay, double by);
-double step_to_kelvin(int step, size_t color_ch);
 
 struct Animation
 {
@@ -25,6 +25,8 @@
 #include <fstream>
 #include <regex>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 using std::cout;
 
@@ -85,7 +87,43 @@ void stop()
 
 void status()
 {
-	cout << (set_lock() == 0 ? "not running" : "running") << "\n";
+	if (set_lock() == 0) {
+		cout << "not running\n";
+		std::exit(0);
+	}
+	cout << "running\n";
+
+	// Opened first, so the daemon has someone to reply to
+	const int fd = open(status_fifo_name, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		std::exit(0);
+
+	send("status");
+
+	std::string s;
+	char buf[4096];
+	pollfd pfd {fd, POLLIN, 0};
+	while (poll(&pfd, 1, 1000) > 0) {
+		const ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		s.append(buf, n);
+	}
+	close(fd);
+
+	const auto j = nlohmann::json::parse(s, nullptr, false);
+	if (j.is_discarded())
+		std::exit(0);
+
+	const double ramp_lookups = double(j.value("ramp_cache_hits", uint64_t(0)) + j.value("ramp_cache_misses", uint64_t(0)));
+	if (ramp_lookups > 0)
+		cout << "ramp cache hit rate: " << int(100 * j.value("ramp_cache_hits", uint64_t(0)) / ramp_lookups) << "%\n";
+
+	for (size_t i = 0; i < j["screens"].size(); ++i) {
+		cout << "screen " << i << ":\n";
+		for (const auto &el : j["screens"][i].items())
+			cout << "  " << el.key() << ": " << el.value() << '\n';
+	}
 	std::exit(0);
 }
 
@@ -104,6 +142,30 @@ std::string time_format_callback(const std::string &s)
 	return std::string("");
 }
 
+std::regex geometry_pattern("^(\\d+)x(\\d+)\\+(\\d+)\\+(\\d+)$");
+
+std::string geometry_callback(const std::string &s)
+{
+	if (s == "none" || std::regex_search(s, geometry_pattern))
+		return std::string("");
+	return std::string("option should match the WxH+X+Y format, or be `none`.");
+}
+
+// [x, y, w, h] arrays, or null if the option wasn't given
+nlohmann::json rects_to_json(const std::vector<std::string> &v)
+{
+	if (v.empty())
+		return nullptr;
+
+	nlohmann::json ret = nlohmann::json::array();
+	for (const auto &s : v) {
+		std::smatch m;
+		if (std::regex_search(s, m, geometry_pattern))
+			ret.push_back({std::stoi(m[3]), std::stoi(m[4]), std::stoi(m[1]), std::stoi(m[2])});
+	}
+	return ret;
+}
+
 int main(int argc, const char **argv)
 {
 	CLI::App app("Screen manager for X11.", "gummy");
@@ -120,6 +182,7 @@ int main(int argc, const char **argv)
 	int brt_auto_offset = -1;
 	int brt_auto_speed  = -1;
 	int scr_rate        = -1;
+	int scr_rate_max    = -1;
 	int als_poll        = -1;
 	int temp            = -1;
 	int tm              = -1;
@@ -128,6 +191,9 @@ int main(int argc, const char **argv)
 	int adapt_time      = -1;
 	std::string sunrise_time;
 	std::string sunset_time;
+	std::vector<std::string> include_rects;
+	std::vector<std::string> exclude_rects;
+	int active_window   = -1;
 
 	app.add_flag("-v,--version", [] ([[maybe_unused]] int64_t t) {
 		cout << VERSION << '\n';
@@ -152,8 +218,16 @@ int main(int argc, const char **argv)
 	               "Set brightness adaptation speed in milliseconds. Default is 1000 ms.")->check(CLI::Range(1, 10000))->group(brt_grp);
 	app.add_option("--screen-poll-rate", scr_rate,
 	               "How often to check for screen image changes in milliseconds. Only relevant for screens with brightness mode 1.")->check(CLI::Range(1, 5000))->group(brt_grp);
+	app.add_option("--screen-poll-rate-max", scr_rate_max,
+	               "Slowest screen polling rate in milliseconds. Polling slows down towards it while the screen doesn't change,\nand is back to --screen-poll-rate on the first change. Only relevant for screens with brightness mode 1.")->check(CLI::Range(1, 60000))->group(brt_grp);
 	app.add_option("--als-poll-rate", als_poll,
 	               "How often to check for ambient light changes in milliseconds. Only relevant for screens with brightness mode 2.")->check(CLI::Range(1, 30000))->group(brt_grp);
+	app.add_option("--include", include_rects,
+	               "Only measure screenshot brightness inside this area, in the WxH+X+Y format. Can be repeated.\n`none` clears it.")->check(geometry_callback)->group(brt_grp);
+	app.add_option("--exclude", exclude_rects,
+	               "Ignore this area when measuring screenshot brightness, in the WxH+X+Y format. Can be repeated.\n`none` clears it.")->check(geometry_callback)->group(brt_grp);
+	app.add_option("--active-window", active_window,
+	               "Only measure screenshot brightness inside the focused window, when it's on the screen. 0 = off, 1 = on.")->check(CLI::Range(0, 1))->group(brt_grp);
 
 	std::string temp_grp("Temperature options");
 	app.add_option("-t,--temperature", temp,
@@ -192,6 +266,7 @@ int main(int argc, const char **argv)
 		{"brt_auto_offset", brt_auto_offset},
 		{"brt_auto_speed", brt_auto_speed},
 		{"brt_auto_screenshot_rate", scr_rate},
+		{"brt_auto_screenshot_rate_max", scr_rate_max},
 		{"brt_auto_als_poll_rate", als_poll},
 		{"temp_mode", tm},
 		{"brt_perc", brt},
@@ -201,6 +276,9 @@ int main(int argc, const char **argv)
 		{"sunrise_time", sunrise_time},
 		{"sunset_time", sunset_time},
 		{"temp_adaptation_time", adapt_time},
+		{"brt_auto_include", rects_to_json(include_rects)},
+		{"brt_auto_exclude", rects_to_json(exclude_rects)},
+		{"brt_auto_active_window", active_window},
 	};
 
 	send(msg.dump());
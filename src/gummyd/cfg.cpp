@@ -29,6 +29,9 @@ Config::Config()
     : _path(path()),
       brt_auto_fps(60),
       als_polling_rate(5000),
+      brt_auto_buffer_timeout(60),
+      idle_timeout(0),
+      brt_auto_sync_groups(),
       temp_auto(false),
       temp_auto_fps(45),
       temp_auto_speed(60),
@@ -47,6 +50,17 @@ Config::Screen::Screen()
       brt_auto_speed(1000),
       brt_auto_threshold(8),
       brt_auto_polling_rate(1000),
+      brt_auto_polling_rate_max(4000),
+      brt_auto_damage(true),
+      brt_auto_capture(CAPTURE_SHM),
+      brt_auto_strips(16),
+      brt_auto_strip_height(4),
+      brt_auto_sample_error(2.),
+      brt_auto_luma(LUMA_GAMMA),
+      brt_auto_stat(LUMA_MEAN),
+      brt_auto_include(),
+      brt_auto_exclude(),
+      brt_auto_active_window(false),
       brt_step(brt_steps_max),
       temp_auto(false),
       temp_step(0)
@@ -124,6 +138,9 @@ void Config::from_json(const json &in)
 {
 	brt_auto_fps      = in["brt_auto_fps"];
 	als_polling_rate  = in["als_polling_rate"];
+	brt_auto_buffer_timeout = in["brt_auto_buffer_timeout"];
+	idle_timeout      = in["idle_timeout"];
+	brt_auto_sync_groups = in["brt_auto_sync_groups"].get<std::vector<std::vector<int>>>();
 	temp_auto         = in["temp_auto"];
 	temp_auto_fps     = in["temp_auto_fps"];
 	temp_auto_speed   = in["temp_auto_speed"];
@@ -141,6 +158,17 @@ void Config::from_json(const json &in)
 		    in["screens"][i]["brt_auto_speed"],
 		    in["screens"][i]["brt_auto_threshold"],
 		    in["screens"][i]["brt_auto_polling_rate"],
+		    in["screens"][i]["brt_auto_polling_rate_max"],
+		    in["screens"][i]["brt_auto_damage"],
+		    in["screens"][i]["brt_auto_capture"],
+		    in["screens"][i]["brt_auto_strips"],
+		    in["screens"][i]["brt_auto_strip_height"],
+		    in["screens"][i]["brt_auto_sample_error"],
+		    in["screens"][i]["brt_auto_luma"],
+		    in["screens"][i]["brt_auto_stat"],
+		    in["screens"][i]["brt_auto_include"],
+		    in["screens"][i]["brt_auto_exclude"],
+		    in["screens"][i]["brt_auto_active_window"],
 		    in["screens"][i]["brt_step"],
 		    in["screens"][i]["temp_auto"],
 		    in["screens"][i]["temp_step"]
@@ -148,6 +176,19 @@ void Config::from_json(const json &in)
 	}
 }
 
+void to_json(json &j, const Rect &r)
+{
+	j = json::array({r.x, r.y, r.w, r.h});
+}
+
+void from_json(const json &j, Rect &r)
+{
+	r.x = j.at(0);
+	r.y = j.at(1);
+	r.w = j.at(2);
+	r.h = j.at(3);
+}
+
 json json_sanitize(const json &j)
 {
 	Config default_config = Config();
@@ -179,6 +220,17 @@ json screen_to_json(const Config::Screen &s)
 	     {"brt_auto_speed", s.brt_auto_speed},
 	     {"brt_auto_threshold", s.brt_auto_threshold},
 	     {"brt_auto_polling_rate", s.brt_auto_polling_rate},
+	     {"brt_auto_polling_rate_max", s.brt_auto_polling_rate_max},
+	     {"brt_auto_damage", s.brt_auto_damage},
+	     {"brt_auto_capture", s.brt_auto_capture},
+	     {"brt_auto_strips", s.brt_auto_strips},
+	     {"brt_auto_strip_height", s.brt_auto_strip_height},
+	     {"brt_auto_sample_error", s.brt_auto_sample_error},
+	     {"brt_auto_luma", s.brt_auto_luma},
+	     {"brt_auto_stat", s.brt_auto_stat},
+	     {"brt_auto_include", s.brt_auto_include},
+	     {"brt_auto_exclude", s.brt_auto_exclude},
+	     {"brt_auto_active_window", s.brt_auto_active_window},
 	     {"brt_step", s.brt_step},
 	     {"temp_auto", s.temp_auto},
 	     {"temp_step", s.temp_step},
@@ -190,6 +242,9 @@ json Config::to_json()
 	json ret({
 	    {"brt_auto_fps", brt_auto_fps},
 	    {"als_polling_rate", als_polling_rate},
+	    {"brt_auto_buffer_timeout", brt_auto_buffer_timeout},
+	    {"idle_timeout", idle_timeout},
+	    {"brt_auto_sync_groups", brt_auto_sync_groups},
 	    {"temp_auto", temp_auto},
 	    {"temp_auto_fps", temp_auto_fps},
 	    {"temp_auto_speed", temp_auto_speed},
@@ -227,6 +282,17 @@ Config::Screen::Screen(
     int brt_auto_speed,
     int brt_auto_threshold,
     int brt_auto_polling_rate,
+    int brt_auto_polling_rate_max,
+    bool brt_auto_damage,
+    Capture_backend brt_auto_capture,
+    int brt_auto_strips,
+    int brt_auto_strip_height,
+    double brt_auto_sample_error,
+    Luma_mode brt_auto_luma,
+    Luma_stat brt_auto_stat,
+    std::vector<Rect> brt_auto_include,
+    std::vector<Rect> brt_auto_exclude,
+    bool brt_auto_active_window,
     int brt_step,
     bool temp_auto,
     int temp_step
@@ -237,6 +303,17 @@ Config::Screen::Screen(
     brt_auto_speed(brt_auto_speed),
     brt_auto_threshold(brt_auto_threshold),
     brt_auto_polling_rate(brt_auto_polling_rate),
+    brt_auto_polling_rate_max(brt_auto_polling_rate_max),
+    brt_auto_damage(brt_auto_damage),
+    brt_auto_capture(brt_auto_capture),
+    brt_auto_strips(brt_auto_strips),
+    brt_auto_strip_height(brt_auto_strip_height),
+    brt_auto_sample_error(brt_auto_sample_error),
+    brt_auto_luma(brt_auto_luma),
+    brt_auto_stat(brt_auto_stat),
+    brt_auto_include(brt_auto_include),
+    brt_auto_exclude(brt_auto_exclude),
+    brt_auto_active_window(brt_auto_active_window),
     brt_step(brt_step),
     temp_auto(temp_auto),
     temp_step(temp_step)
@@ -254,6 +331,7 @@ Message::Message(const std::string &j)
 	brt_auto_offset      = msg["brt_auto_offset"];
 	brt_auto_speed       = msg["brt_auto_speed"];
 	screenshot_rate_ms   = msg["brt_auto_screenshot_rate"];
+	screenshot_rate_max_ms = msg["brt_auto_screenshot_rate_max"];
 	als_poll_rate_ms     = msg["brt_auto_als_poll_rate"];
 	temp_k               = msg["temp_k"];
 	temp_auto            = msg["temp_mode"];
@@ -262,4 +340,15 @@ Message::Message(const std::string &j)
 	sunrise_time         = msg["sunrise_time"];
 	sunset_time          = msg["sunset_time"];
 	temp_adaptation_time = msg["temp_adaptation_time"];
+	active_window        = msg["brt_auto_active_window"];
+
+	// null unless given
+	if (!msg["brt_auto_include"].is_null()) {
+		set_include = true;
+		include     = msg["brt_auto_include"].get<std::vector<Rect>>();
+	}
+	if (!msg["brt_auto_exclude"].is_null()) {
+		set_exclude = true;
+		exclude     = msg["brt_auto_exclude"].get<std::vector<Rect>>();
+	}
 }
@@ -21,9 +21,11 @@
 
 #include "json.hpp"
 #include "../common/defs.h"
+#include "../common/utils.h"
 
 using json = nlohmann::json;
 enum Brt_mode { MANUAL, SCREENSHOT, ALS };
+enum Capture_backend { CAPTURE_SHM, CAPTURE_RENDER, CAPTURE_STRIPS, CAPTURE_PATCHES };
 struct Config
 {
 	struct Screen
@@ -37,6 +39,17 @@ struct Config
 		    int brt_auto_speed,
 		    int brt_auto_threshold,
 		    int brt_auto_polling_rate,
+		    int brt_auto_polling_rate_max,
+		    bool brt_auto_damage,
+		    Capture_backend brt_auto_capture,
+		    int brt_auto_strips,
+		    int brt_auto_strip_height,
+		    double brt_auto_sample_error,
+		    Luma_mode brt_auto_luma,
+		    Luma_stat brt_auto_stat,
+		    std::vector<Rect> brt_auto_include,
+		    std::vector<Rect> brt_auto_exclude,
+		    bool brt_auto_active_window,
 		    int brt_step,
 		    bool temp_auto,
 		    int temp_step
@@ -48,6 +61,17 @@ struct Config
 		int brt_auto_speed; // ms
 		int brt_auto_threshold;
 		int brt_auto_polling_rate; // ms
+		int brt_auto_polling_rate_max; // ms, the rate backs off up to while the screen doesn't change
+		bool brt_auto_damage; // only capture after XDamage reports changes
+		Capture_backend brt_auto_capture;
+		int brt_auto_strips;       // horizontal bands read by CAPTURE_STRIPS
+		int brt_auto_strip_height; // px
+		double brt_auto_sample_error; // brightness levels (0-255) sampling may be off by
+		Luma_mode brt_auto_luma;
+		Luma_stat brt_auto_stat;
+		std::vector<Rect> brt_auto_include; // px, screenshot brightness is measured inside
+		std::vector<Rect> brt_auto_exclude; // and not inside of these
+		bool brt_auto_active_window; // only measure the focused window, if on this screen
 		int brt_step;
 		bool temp_auto;
 		int temp_step;
@@ -57,6 +81,9 @@ struct Config
 	const std::string _path;
 	int brt_auto_fps;
 	int als_polling_rate; // ms
+	int brt_auto_buffer_timeout; // s
+	int idle_timeout; // s without input before pausing, 0 only pauses when the display is off
+	std::vector<std::vector<int>> brt_auto_sync_groups; // screens captured once, sharing brightness
 	bool temp_auto;
 	int temp_auto_fps;
 	int temp_auto_speed;
@@ -74,6 +101,10 @@ struct Config
 	json to_json();
 };
 
+// Rectangles are [x, y, w, h] arrays
+void to_json(json &, const Rect &);
+void from_json(const json &, Rect &);
+
 json json_sanitize(const json&);
 json screen_to_json(const Config::Screen &s);
 
@@ -90,6 +121,7 @@ struct Message
 	int brt_auto_offset      = -1;
 	int brt_auto_speed       = -1;
 	int screenshot_rate_ms   = -1;
+	int screenshot_rate_max_ms = -1;
 	int als_poll_rate_ms     = -1;
 	int temp_auto            = -1;
 	int temp_k               = -1;
@@ -98,6 +130,11 @@ struct Message
 	int temp_adaptation_time = -1;
 	std::string sunrise_time;
 	std::string sunset_time;
+	bool set_include         = false;
+	bool set_exclude         = false;
+	std::vector<Rect> include;
+	std::vector<Rect> exclude;
+	int active_window        = -1;
 };
 
 #endif // CFG_H
@@ -24,9 +24,11 @@
 #include "sysfs.h"
 
 #include <syslog.h>
+#include <csignal>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <fstream>
 
 void apply_options(const Message &opts, Xorg &xorg, core::Brightness_Manager &brtctl, core::Temp_Manager &tempctl)
@@ -128,6 +130,23 @@ void apply_options(const Message &opts, Xorg &xorg, core::Brightness_Manager &br
 			cfg.screens[i].brt_auto_polling_rate = opts.screenshot_rate_ms;
 		}
 
+		if (opts.screenshot_rate_max_ms != -1) {
+			cfg.screens[i].brt_auto_polling_rate_max = opts.screenshot_rate_max_ms;
+		}
+
+		if (opts.set_include || opts.set_exclude) {
+			if (opts.set_include)
+				cfg.screens[i].brt_auto_include = opts.include;
+			if (opts.set_exclude)
+				cfg.screens[i].brt_auto_exclude = opts.exclude;
+			xorg.set_region(i, {cfg.screens[i].brt_auto_include, cfg.screens[i].brt_auto_exclude});
+		}
+
+		if (opts.active_window != -1) {
+			cfg.screens[i].brt_auto_active_window = bool(opts.active_window);
+			xorg.set_active_only(i, cfg.screens[i].brt_auto_active_window);
+		}
+
 		if (opts.temp_k != -1) {
 			cfg.screens[i].temp_step = int(remap(opts.temp_k, temp_k_min, temp_k_max, 0, temp_steps_max));
 			cfg.screens[i].temp_auto = false;
@@ -154,6 +173,54 @@ void init_fifo()
 		syslog(LOG_ERR, "mkfifo err %d, aborting\n", errno);
 		exit(1);
 	}
+	if (mkfifo(status_fifo_name, S_IFIFO|0640) == -1 && errno != EEXIST) {
+		syslog(LOG_ERR, "status mkfifo err %d\n", errno);
+	}
+}
+
+/**
+ * Replies to `gummy status` on the status fifo, which the client opens
+ * before asking. Without a reader, opening fails instead of blocking.
+ * Writes don't block either: a full pipe, or a client that closed its end
+ * (EAGAIN, EPIPE), means it went away, and the reply is dropped. */
+void write_status(const Xorg &xorg, const core::Brightness_Manager &brtctl)
+{
+	const Ramp_cache_stats rs = xorg.ramp_stats();
+	json j {
+	    {"ramp_cache_hits", rs.hits},
+	    {"ramp_cache_misses", rs.misses},
+	    {"screens", json::array()},
+	};
+	for (size_t i = 0; i < cfg.screens.size(); ++i) {
+		const auto &scr = cfg.screens[i];
+		const Capture_stats st = xorg.stats(i);
+		j["screens"].push_back({
+		    {"brt_mode", scr.brt_mode},
+		    {"brt_step", scr.brt_step},
+		    {"temp_step", scr.temp_step},
+		    {"polling_rate_ms", brtctl.monitors[i].polling_rate},
+		    {"unchanged_frames", st.fingerprint_hits},
+		    {"changed_frames", st.fingerprint_misses},
+		});
+	}
+
+	const int fd = open(status_fifo_name, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "status fifo open err %d", errno);
+		return;
+	}
+	const std::string s(j.dump());
+	size_t written = 0;
+	while (written < s.size()) {
+		const ssize_t n = write(fd, s.c_str() + written, s.size() - written);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EPIPE)
+				syslog(LOG_WARNING, "status fifo write err %d", errno);
+			break;
+		}
+		written += size_t(n);
+	}
+	close(fd);
 }
 
 int message_loop(Xorg &xorg, core::Brightness_Manager &brtctl, core::Temp_Manager &tempctl)
@@ -171,6 +238,11 @@ int message_loop(Xorg &xorg, core::Brightness_Manager &brtctl, core::Temp_Manage
 	if (s == "stop")
 		return 0;
 
+	if (s == "status") {
+		write_status(xorg, brtctl);
+		return message_loop(xorg, brtctl, tempctl);
+	}
+
 	apply_options(Message(s), xorg, brtctl, tempctl);
 	cfg.write();
 
@@ -186,6 +258,9 @@ int main(int argc, char **argv)
 
 	openlog("gummyd", LOG_PID, LOG_DAEMON);
 
+	// Status replies to a client that went away fail with EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+
 	if (int err = set_lock() > 0) {
 		syslog(LOG_ERR, "lockfile err %d", err);
 		exit(1);
@@ -196,6 +271,10 @@ int main(int argc, char **argv)
 
 	// Init cfg
 	cfg.init(xorg.scr_count());
+	for (size_t i = 0; i < xorg.scr_count(); ++i) {
+		xorg.set_region(i, {cfg.screens[i].brt_auto_include, cfg.screens[i].brt_auto_exclude});
+		xorg.set_active_only(i, cfg.screens[i].brt_auto_active_window);
+	}
 
 	// Init fifo
 	init_fifo();
@@ -203,15 +282,20 @@ int main(int argc, char **argv)
 	core::Gamma_Refresh g;
 	core::Brightness_Manager b(xorg);
 	core::Temp_Manager t(&xorg);
+	core::Idle_Watch i;
 
 	std::vector<std::thread> threads;
-	threads.reserve(3);
+	threads.reserve(5);
 	threads.emplace_back([&] { g.loop(xorg); });
 	threads.emplace_back([&] { b.start(); });
 	threads.emplace_back([&] { core::temp_init(t); });
+	threads.emplace_back([&] { i.loop(xorg, b, t, g); });
+	threads.emplace_back([&] { xorg.event_loop([&] (int scr_idx) { b.capture_now(scr_idx); }); });
 
 	message_loop(xorg, b, t);
 
+	xorg.events_stop();
+	i.stop();
 	temp_stop(t);
 	b.stop();
 	g.stop();
@@ -22,13 +22,15 @@
 
 #include <mutex>
 #include <ctime>
+#include <limits>
 #include <sdbus-c++/sdbus-c++.h>
 #include <syslog.h>
 
 core::Temp_Manager::Temp_Manager(Xorg *xorg)
     : xorg(xorg),
       current_step(0),
-      notified(false)
+      notified(false),
+      idle(false)
 {
 	auto_sync.wake_up = false;
 	clock_sync.wake_up = false;
@@ -81,6 +83,13 @@ void core::temp_stop(Temp_Manager &t)
 	t.clock_sync.cv.notify_one();
 }
 
+void core::temp_idle(Temp_Manager &t, bool idle)
+{
+	t.idle = idle;
+	if (!idle)
+		temp_notify(t);
+}
+
 void core::temp_time_check_loop(Temp_Manager &t)
 {
 	using namespace std::chrono;
@@ -170,7 +179,7 @@ void core::temp_animation_loop(Temp_Manager &t, Animation a, int prev_step, int
 
 	if (cur_step == target_step)
 		return;	
-	if (t.notified || !cfg.temp_auto || t.auto_sync.wake_up)
+	if (t.notified || t.idle || !cfg.temp_auto || t.auto_sync.wake_up)
 		return;
 
 	a.elapsed += a.slice;
@@ -214,7 +223,9 @@ void core::temp_on_system_wakeup(Temp_Manager &t)
 
 core::Brightness_Manager::Brightness_Manager(Xorg &xorg)
      : backlights(Sysfs::get_bl()),
-       als(Sysfs::get_als())
+       als(Sysfs::get_als()),
+       engine(xorg, monitors, capture_ev),
+       idle(false)
 {
 	monitors.reserve(xorg.scr_count());
 	threads.reserve(xorg.scr_count());
@@ -223,7 +234,7 @@ core::Brightness_Manager::Brightness_Manager(Xorg &xorg)
 		monitors.emplace_back(&xorg,
 		                      i < backlights.size() ? &backlights[i] : nullptr,
 		                      als.size() > 0 ? &als[0] : nullptr,
-		                      &als_ev,
+		                      &capture_ev,
 		                      i);
 	}
 
@@ -233,24 +244,42 @@ core::Brightness_Manager::Brightness_Manager(Xorg &xorg)
 void core::Brightness_Manager::start()
 {
 	als_stop.wake_up = false;
-	als_ev.wake_up = false;
+	capture_ev.wake_up = false;
 	if (als.size() > 0)
-		threads.emplace_back([&] { als_capture_loop(als[0], als_stop, als_ev); });
+		threads.emplace_back([&] { als_capture_loop(als[0], als_stop, capture_ev, idle); });
+	engine.groups_init();
+	threads.emplace_back([&] { engine.loop(); });
 	for (auto &m : monitors)
 		threads.emplace_back([&] { monitor_init(m); });
 }
 
+void core::Brightness_Manager::set_idle(bool idle)
+{
+	{
+		std::lock_guard lk(als_stop.mtx);
+		this->idle = idle;
+	}
+	als_stop.cv.notify_one();
+	for (auto &m : monitors)
+		monitor_idle(m, idle);
+}
+
+void core::Brightness_Manager::capture_now(int scr_idx)
+{
+	monitor_capture_now(monitors[scr_idx]);
+}
+
 void core::Brightness_Manager::stop()
 {
 	als_capture_stop(als_stop);
-	als_capture_stop(als_ev);
+	engine.stop();
 	for (auto &m : monitors)
 		monitor_stop(m);
 	for (auto &t : threads)
 		t.join();
 }
 
-void core::als_capture_loop(Sysfs::ALS &als, Sync &stop, Sync &ev)
+void core::als_capture_loop(Sysfs::ALS &als, Sync &stop, Sync &ev, const bool &idle)
 {
 	const int prev_step = als.lux_step();
 	als.update();
@@ -259,15 +288,19 @@ void core::als_capture_loop(Sysfs::ALS &als, Sync &stop, Sync &ev)
 	{
 		std::unique_lock lk(stop.mtx);
 		stop.cv.wait_for(lk, std::chrono::milliseconds(cfg.als_polling_rate));
+		stop.cv.wait(lk, [&] { return !idle || stop.wake_up; });
+		if (stop.wake_up)
+			return;
 	}
-	if (stop.wake_up)
-		return;
-	als_capture_loop(als, stop, ev);
+	als_capture_loop(als, stop, ev, idle);
 }
 
 void core::als_capture_stop(Sync &stop)
 {
-	stop.wake_up = true;
+	{
+		std::lock_guard lk(stop.mtx);
+		stop.wake_up = true;
+	}
 	stop.cv.notify_one();
 }
 
@@ -278,27 +311,24 @@ void core::als_notify(Sync &ev)
 	ev.cv.notify_one();
 }
 
-int core::als_await(Sysfs::ALS &als, Sync &ev)
-{
-	std::unique_lock lk(ev.mtx);
-	ev.cv.wait(lk, [&] { return ev.wake_up; });
-	ev.wake_up = false;
-	return als.lux_step();
-}
-
 core::Monitor::Monitor(Xorg *xorg,
 		Sysfs::Backlight *bl,
         Sysfs::ALS *als,
-        Sync *als_ev,
+        Sync *capture_ev,
 		int id)
    :  xorg(xorg),
       backlight(bl),
       als(als),
-      als_ev(als_ev),
+      capture_ev(capture_ev),
       id(id),
       ss_brt(0),
-      flags({cfg.screens[id].brt_mode == MANUAL,0,0})
+      polling_rate(cfg.screens[id].brt_auto_polling_rate),
+      prev({0,0,0,0,0}),
+      ss_delta(0),
+      capture_mode(MANUAL),
+      flags({cfg.screens[id].brt_mode == MANUAL,0,0,0,0})
 {
+	brt_ev.wake_up = false;
 	if (!backlight) {
 		xorg->set_gamma(id,
 		                brt_steps_max,
@@ -309,75 +339,64 @@ core::Monitor::Monitor(Xorg *xorg,
 core::Monitor::Monitor(Monitor &&o)
     :  xorg(o.xorg),
        backlight(o.backlight),
+       als(o.als),
+       capture_ev(o.capture_ev),
        id(o.id),
+       ss_brt(o.ss_brt),
+       polling_rate(o.polling_rate),
+       prev(o.prev),
+       ss_delta(o.ss_delta),
+       capture_mode(o.capture_mode),
        flags(o.flags)
 {
-}
-
-void core::monitor_init(Monitor &mon)
-{
-	Sync brt_ev;
 	brt_ev.wake_up = false;
-	std::thread adjust_thr([&] {
-		monitor_brt_adjust_loop(mon, brt_ev, brt_steps_max);
-	});
-	monitor_is_auto_loop(mon, brt_ev);
-	adjust_thr.join();
 }
 
-void core::monitor_is_auto_loop(Monitor &mon, Sync &brt_ev)
+void core::monitor_init(Monitor &mon)
 {
-	std::mutex mtx; {
-		std::unique_lock lk(mtx);
-		mon.cv.wait(lk, [&] { return !mon.flags.paused; });
-	}
-	if (mon.flags.stopped) {
-		{ std::lock_guard lk(brt_ev.mtx);
-		brt_ev.wake_up = true; }
-		brt_ev.cv.notify_one();
-		return;
-	}
-	monitor_capture_loop(mon, brt_ev, *mon.als_ev, Previous_capture_state{0,0,0,0}, 0);
-	monitor_is_auto_loop(mon, brt_ev);
+	monitor_brt_adjust_loop(mon, mon.brt_ev, brt_steps_max);
 }
 
-void core::monitor_capture_loop(Monitor &mon, Sync &brt_ev, Sync &als_ev, Previous_capture_state prev, int ss_delta)
+/**
+ * Control logic run by the capture engine on each new screenshot
+ * or ALS brightness. Wakes up the adjust thread past the threshold. */
+void core::monitor_on_capture(Monitor &mon, int ss_brt)
 {
 	const auto &scr = cfg.screens[mon.id];
-	const int ss_brt = [&] {
-		if (scr.brt_mode == ALS)
-			return als_await(*mon.als, als_ev);
-		return mon.xorg->get_screen_brightness(mon.id);
-	}();
-	if (mon.flags.paused || mon.flags.stopped)
-		return;
-	ss_delta += abs(prev.ss_brt - ss_brt);
-
-	if (ss_delta > scr.brt_auto_threshold) {
-		ss_delta = 0;
+	auto &prev = mon.prev;
+	mon.ss_delta += abs(prev.ss_brt - ss_brt);
+
+	/**
+	 * The polling rate doubles while the screen stays the same, up to
+	 * brt_auto_polling_rate_max, and is back to brt_auto_polling_rate
+	 * as soon as brightness is adjusted. */
+	const int rate_max = std::max(scr.brt_auto_polling_rate, scr.brt_auto_polling_rate_max);
+	prev.polling_rate  = std::clamp(prev.polling_rate * 2, scr.brt_auto_polling_rate, rate_max);
+
+	if (mon.ss_delta > scr.brt_auto_threshold) {
+		mon.ss_delta = 0;
+		prev.polling_rate = scr.brt_auto_polling_rate;
 		{
-			std::lock_guard lk(brt_ev.mtx);
-			brt_ev.wake_up = true;
+			std::lock_guard lk(mon.brt_ev.mtx);
+			mon.brt_ev.wake_up = true;
 			mon.ss_brt = ss_brt;
 		}
-		brt_ev.cv.notify_one();
+		mon.brt_ev.cv.notify_one();
 	}
 
 	if (scr.brt_auto_min != prev.cfg_min
 	    || scr.brt_auto_max != prev.cfg_max
 	    || scr.brt_auto_offset != prev.cfg_offset) {
-		ss_delta = 255;
+		mon.ss_delta = 255;
+		prev.polling_rate = scr.brt_auto_polling_rate;
 		mon.flags.cfg_updated = true; // not worth syncing
 	}
+	mon.polling_rate = prev.polling_rate;
 
 	prev.ss_brt     = ss_brt;
 	prev.cfg_min    = scr.brt_auto_min;
 	prev.cfg_max    = scr.brt_auto_max;
 	prev.cfg_offset = scr.brt_auto_offset;
-
-	if (scr.brt_mode == SCREENSHOT)
-		std::this_thread::sleep_for(std::chrono::milliseconds(scr.brt_auto_polling_rate));
-	monitor_capture_loop(mon, brt_ev, als_ev, prev, ss_delta);
 }
 
 void core::monitor_brt_adjust_loop(Monitor &mon, Sync &brt_ev, int cur_step)
@@ -422,7 +441,7 @@ int core::monitor_brt_animation_loop(Monitor &mon, Animation a, int prev_step, i
 {
 	if (mon.ss_brt != ss_brt)
 		return cur_step;
-	if (mon.flags.paused || mon.flags.cfg_updated || mon.flags.stopped)
+	if (mon.flags.paused || mon.flags.idle || mon.flags.cfg_updated || mon.flags.stopped)
 		return cur_step;
 
 	a.elapsed += a.slice;
@@ -446,20 +465,51 @@ void core::monitor_stop(Monitor &mon)
 {
 	mon.flags.paused = false;
 	mon.flags.stopped = true;
-	mon.cv.notify_one();
+	{
+		std::lock_guard lk(mon.brt_ev.mtx);
+		mon.brt_ev.wake_up = true;
+	}
+	mon.brt_ev.cv.notify_one();
+	monitor_notify(mon);
 }
 
 void core::monitor_pause(Monitor &mon)
 {
 	mon.flags.paused = true;
-	als_notify(*mon.als_ev);
+	monitor_notify(mon);
 }
 
 void core::monitor_resume(Monitor &mon)
 {
 	mon.flags.paused = false;
-	mon.cv.notify_one();
-	als_notify(*mon.als_ev);
+	monitor_notify(mon);
+}
+
+/**
+ * Unlike pausing, this keeps the brightness mode. Once resumed,
+ * the capture state starts over, so the first capture is right away. */
+void core::monitor_idle(Monitor &mon, bool idle)
+{
+	mon.flags.idle = idle;
+	monitor_notify(mon);
+}
+
+void core::monitor_capture_now(Monitor &mon)
+{
+	if (cfg.screens[mon.id].brt_mode != SCREENSHOT)
+		return;
+	mon.flags.capture_now = true;
+	monitor_notify(mon);
+}
+
+// Lets the capture engine know the flags changed
+void core::monitor_notify(Monitor &mon)
+{
+	{
+		std::lock_guard lk(mon.capture_ev->mtx);
+		mon.capture_ev->wake_up = true;
+	}
+	mon.capture_ev->cv.notify_one();
 }
 
 void core::monitor_toggle(Monitor &mon, bool toggle)
@@ -470,6 +520,201 @@ void core::monitor_toggle(Monitor &mon, bool toggle)
 		monitor_pause(mon);
 }
 
+core::Capture_Engine::Capture_Engine(Xorg &xorg, std::vector<Monitor> &monitors, Sync &ev)
+    : _xorg(xorg),
+      _monitors(monitors),
+      _ev(ev),
+      _quit(false)
+{
+}
+
+/**
+ * Merges outputs with the same position and size on the root window
+ * (clones, mirrors), and the sync groups from the config.
+ * Called once the monitors exist, before the loop starts. */
+void core::Capture_Engine::groups_init()
+{
+	const int n = int(_monitors.size());
+	_group_of.resize(n);
+	for (int i = 0; i < n; ++i)
+		_group_of[i] = i;
+
+	const auto merge = [&] (int a, int b) {
+		const int ga = _group_of[a];
+		const int gb = _group_of[b];
+		if (ga == gb)
+			return;
+		for (int &g : _group_of) {
+			if (g == gb)
+				g = ga;
+		}
+	};
+	for (int i = 0; i < n; ++i) {
+		for (int j = i + 1; j < n; ++j) {
+			if (_xorg.area(i) == _xorg.area(j)) {
+				syslog(LOG_INFO, "screens %d and %d are mirrored, capturing them once", i, j);
+				merge(i, j);
+			}
+		}
+	}
+	for (const auto &g : cfg.brt_auto_sync_groups) {
+		for (int id : g) {
+			if (id < 0 || id >= n) {
+				syslog(LOG_WARNING, "sync group screen %d doesn't exist", id);
+				continue;
+			}
+			if (id != g.front() && g.front() >= 0 && g.front() < n)
+				merge(g.front(), id);
+		}
+	}
+
+	// Renumbered from 0, each listing its members in order
+	std::vector<int> index(n, -1);
+	for (int i = 0; i < n; ++i) {
+		int &g = index[_group_of[i]];
+		if (g == -1) {
+			g = int(_groups.size());
+			_groups.emplace_back();
+		}
+		_groups[g].push_back(i);
+		_group_of[i] = g;
+	}
+	_next.resize(_groups.size());
+}
+
+void core::Capture_Engine::stop()
+{
+	{
+		std::lock_guard lk(_ev.mtx);
+		_quit = true;
+		_ev.wake_up = true;
+	}
+	_ev.cv.notify_one();
+}
+
+// First member of a group in screenshot mode, captured for all of them
+int core::Capture_Engine::leader(int group) const
+{
+	for (int id : _groups[group]) {
+		if (_monitors[id].capture_mode == SCREENSHOT)
+			return id;
+	}
+	return -1;
+}
+
+void core::Capture_Engine::schedule(int group, Clock::time_point due)
+{
+	_next[group] = due;
+	_heap.push({ due - _xorg.capture_lead(leader(group)), due, group, true });
+	_heap.push({ due, due, group, false });
+}
+
+// Entries of groups rescheduled, or with no member left capturing
+bool core::Capture_Engine::stale(const Deadline &d) const
+{
+	return leader(d.group) == -1 || _next[d.group] != d.due;
+}
+
+/**
+ * Follows the monitor flags: monitors that start capturing, or switch
+ * mode, do so right away with a new state. ALS brightness is already
+ * polled by its own thread, so it's read on every wake up instead. */
+void core::Capture_Engine::sync_monitors(Clock::time_point now)
+{
+	for (auto &mon : _monitors) {
+		const Brt_mode mode = [&] {
+			if (mon.flags.paused || mon.flags.idle || mon.flags.stopped)
+				return MANUAL;
+			const Brt_mode m = cfg.screens[mon.id].brt_mode;
+			if (m == ALS && !mon.als)
+				return MANUAL;
+			return m;
+		}();
+
+		const int group = _group_of[mon.id];
+		if (mode != mon.capture_mode) {
+			mon.capture_mode = mode;
+			mon.prev         = { 0, 0, 0, 0, 0 };
+			mon.ss_delta     = 0;
+			if (mode == SCREENSHOT)
+				schedule(group, now);
+		}
+
+		if (mon.flags.capture_now) {
+			mon.flags.capture_now = false;
+			// Windows are drawn some time after the switch
+			if (mode == SCREENSHOT)
+				schedule(group, now + std::chrono::milliseconds(switch_capture_delay_ms));
+		}
+
+		if (mode == ALS)
+			monitor_on_capture(mon, mon.als->lux_step());
+	}
+}
+
+void core::Capture_Engine::loop()
+{
+	assert(_group_of.size() == _monitors.size());
+
+	const auto now = Clock::now();
+	sync_monitors(now);
+
+	std::vector<int> requests;
+	std::vector<int> captures;
+	while (!_heap.empty() && _heap.top().at <= now + capture_slack) {
+		const Deadline d = _heap.top();
+		_heap.pop();
+		if (stale(d))
+			continue;
+		if (d.request)
+			requests.push_back(leader(d.group));
+		else
+			captures.push_back(d.group);
+	}
+
+	/**
+	 * Frames of due captures are requested too, so their round trips overlap.
+	 * Only full frames are pipelined, see Xorg::pipelined(). With damage
+	 * tracking, which is the default, capture_request() does nothing: the
+	 * dirty tiles are only known at capture time, so each output's tiles are
+	 * fetched on their own in get_screen_brightness(), one after another. */
+	for (int g : captures)
+		requests.push_back(leader(g));
+	for (int id : requests)
+		_xorg.capture_request(id);
+	if (!requests.empty())
+		_xorg.flush();
+
+	for (int g : captures) {
+		const int ss_brt = _xorg.get_screen_brightness(leader(g));
+		int rate = std::numeric_limits<int>::max();
+		for (int id : _groups[g]) {
+			Monitor &mon = _monitors[id];
+			if (mon.capture_mode != SCREENSHOT)
+				continue;
+			// Unscheduled on the next wake up otherwise
+			if (mon.flags.paused || mon.flags.idle || mon.flags.stopped)
+				continue;
+			monitor_on_capture(mon, ss_brt);
+			rate = std::min(rate, mon.prev.polling_rate);
+		}
+		schedule(g, now + std::chrono::milliseconds(rate));
+	}
+
+	{
+		std::unique_lock lk(_ev.mtx);
+		const auto woken = [this] { return _ev.wake_up; };
+		if (_heap.empty())
+			_ev.cv.wait(lk, woken);
+		else
+			_ev.cv.wait_until(lk, _heap.top().at, woken);
+		_ev.wake_up = false;
+		if (_quit)
+			return;
+	}
+	loop();
+}
+
 int core::calc_brt_target_als(int als_brt, int min, int max, int offset)
 {
 	const int offset_step = offset * brt_steps_max / max;
@@ -483,13 +728,25 @@ int core::calc_brt_target(int ss_brt, int min, int max, int offset)
 	return std::clamp(brt_steps_max - ss_step + offset_step, min, max);
 }
 
-core::Gamma_Refresh::Gamma_Refresh() : _quit(false)
+core::Gamma_Refresh::Gamma_Refresh() : _quit(false), _idle(false)
 {
 }
 
+void core::Gamma_Refresh::idle(bool idle)
+{
+	{
+		std::lock_guard lk(_mtx);
+		_idle = idle;
+	}
+	_cv.notify_one();
+}
+
 void core::Gamma_Refresh::stop()
 {
-	_quit = true;
+	{
+		std::lock_guard lk(_mtx);
+		_quit = true;
+	}
 	_cv.notify_one();
 }
 
@@ -504,16 +761,70 @@ void core::Gamma_Refresh::loop(Xorg &xorg)
 		               cfg.screens[i].temp_step);
 	}
 
-	std::mutex mtx;
-	std::unique_lock lk(mtx);
-	_cv.wait_until(lk, system_clock::now() + 10s, [this] {
-		return _quit;
-	});
-	if (_quit)
-		return;
+	xorg.release_idle_buffers();
+
+	{
+		std::unique_lock lk(_mtx);
+		_cv.wait_until(lk, system_clock::now() + 10s, [this] {
+			return _quit;
+		});
+		_cv.wait(lk, [this] {
+			return _quit || !_idle;
+		});
+		if (_quit)
+			return;
+	}
 	loop(xorg);
 }
 
+core::Idle_Watch::Idle_Watch() : _quit(false), _idle(false)
+{
+}
+
+void core::Idle_Watch::stop()
+{
+	{
+		std::lock_guard lk(_mtx);
+		_quit = true;
+	}
+	_cv.notify_one();
+}
+
+void core::Idle_Watch::set(bool idle, Brightness_Manager &b, Temp_Manager &t, Gamma_Refresh &g)
+{
+	_idle = idle;
+	b.set_idle(idle);
+	temp_idle(t, idle);
+	g.idle(idle);
+}
+
+void core::Idle_Watch::loop(Xorg &xorg, Brightness_Manager &b, Temp_Manager &t, Gamma_Refresh &g)
+{
+	using namespace std::chrono;
+	using namespace std::chrono_literals;
+
+	const bool idle = [&] {
+		if (xorg.display_off())
+			return true;
+		if (cfg.idle_timeout <= 0)
+			return false;
+		const int ms = xorg.idle_ms();
+		return ms >= 0 && ms >= cfg.idle_timeout * 1000;
+	}();
+	if (idle != _idle)
+		set(idle, b, t, g);
+
+	{
+		std::unique_lock lk(_mtx);
+		_cv.wait_until(lk, system_clock::now() + 1s, [this] {
+			return _quit;
+		});
+		if (_quit)
+			return;
+	}
+	loop(xorg, b, t, g);
+}
+
 void timestamps_update(Timestamps &ts)
 {
 	// Get current timestamp
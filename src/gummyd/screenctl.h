@@ -25,6 +25,7 @@
 #include "../common/utils.h"
 
 #include <thread>
+#include <queue>
 #include <condition_variable>
 #include <sdbus-c++/ProxyInterfaces.h>
 
@@ -45,6 +46,9 @@ struct Sync
 
 namespace core {
 
+// Delay of captures triggered by focus and workspace switches
+constexpr int switch_capture_delay_ms = 50;
+
 /**
  * Temperature is adjusted in two steps.
  * The first one is for quickly catching up to the proper temperature when:
@@ -59,75 +63,135 @@ struct Temp_Manager
 	Sync clock_sync;
 	int  current_step;
 	bool notified;
+	bool idle; // animations are paused
 };
 
 void temp_on_system_wakeup(Temp_Manager&);
 void temp_init(Temp_Manager&);
 void temp_notify(Temp_Manager&);
 void temp_stop(Temp_Manager&);
+void temp_idle(Temp_Manager&, bool);
 
 void temp_start(Temp_Manager&);
 void temp_time_check_loop(Temp_Manager&);
 void temp_adjust_loop(Temp_Manager&, Timestamps&, bool catch_up);
 void temp_animation_loop(Temp_Manager&, Animation, int prev_step, int cur_step, int target_step);
 
+struct Previous_capture_state
+{
+	int ss_brt;
+	int cfg_min;
+	int cfg_max;
+	int cfg_offset;
+	int polling_rate;
+};
+
 struct Monitor
 {
-	Monitor(Xorg*, Sysfs::Backlight*, Sysfs::ALS*, Sync *als_ev, int id);
+	Monitor(Xorg*, Sysfs::Backlight*, Sysfs::ALS*, Sync *capture_ev, int id);
 	Monitor(Monitor&&);
-	std::condition_variable cv;
 	Xorg                    *xorg;
 	Sysfs::Backlight        *backlight;
 	Sysfs::ALS              *als;
-	Sync                    *als_ev;
+	Sync                    *capture_ev; // wakes up the capture engine
+	Sync                    brt_ev;      // wakes up the adjust thread
 	int id;
 	int ss_brt;
+	int polling_rate; // ms, effective in screenshot mode
+
+	// Owned by the capture engine
+	Previous_capture_state prev;
+	int ss_delta;
+	Brt_mode capture_mode; // scheduled for, MANUAL if not
+
 	struct {
 		bool paused;
 		bool stopped;
 		bool cfg_updated;
+		bool idle; // captures are paused until the user is back
+		bool capture_now; // focus or workspace switched
 	} flags;
 };
 
-struct Previous_capture_state
-{
-	int ss_brt;
-	int cfg_min;
-	int cfg_max;
-	int cfg_offset;
-};
-
 void monitor_init(Monitor&);
 void monitor_pause(Monitor&);
 void monitor_resume(Monitor&);
 void monitor_stop(Monitor&);
 void monitor_toggle(Monitor&, bool);
+void monitor_idle(Monitor&, bool);
+void monitor_capture_now(Monitor&);
+void monitor_notify(Monitor&);
 
-void monitor_is_auto_loop(Monitor&, Sync &brt_sync);
-void monitor_capture_loop(Monitor&, Sync &brt_ev, Sync &als_ev, Previous_capture_state, int ss_delta);
+void monitor_on_capture(Monitor&, int ss_brt);
 void monitor_brt_adjust_loop(Monitor&, Sync &brt_sync, int cur_step);
 int  monitor_brt_animation_loop(Monitor&, Animation, int prev_step, int cur_step, int target_step, int ss_brt);
 
 int  calc_brt_target(int ss_brt, int min, int max, int offset);
 int  calc_brt_target_als(int als_brt, int min, int max, int offset);
 
+// Deadlines this close to each other are served in the same batch
+constexpr auto capture_slack = std::chrono::milliseconds(2);
+
+/**
+ * Captures every output from a single thread. Outputs showing the same
+ * area, and the sync groups in the config, are captured once per group,
+ * the brightness going to each member. Each scheduled group has a
+ * deadline in a min-heap, with one more entry ahead of it when the frame
+ * can be requested early. Full frame requests that are due together go
+ * out in one flush, before any reply is waited for. Tiles fetched through
+ * damage tracking aren't batched across outputs. Results are handed to
+ * monitor_on_capture(), which wakes the adjust threads. */
+class Capture_Engine
+{
+public:
+	Capture_Engine(Xorg&, std::vector<Monitor>&, Sync &ev);
+	void groups_init();
+	void loop();
+	void stop();
+private:
+	using Clock = std::chrono::steady_clock;
+	struct Deadline
+	{
+		Clock::time_point at;
+		Clock::time_point due; // capture time, stale unless the group's
+		int group;
+		bool request;          // only request the frame
+		bool operator>(const Deadline &d) const { return at > d.at; }
+	};
+	void sync_monitors(Clock::time_point now);
+	void schedule(int group, Clock::time_point due);
+	int  leader(int group) const;
+	bool stale(const Deadline&) const;
+	std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> _heap;
+	std::vector<std::vector<int>> _groups; // of monitor ids, every monitor in one
+	std::vector<int> _group_of;
+	std::vector<Clock::time_point> _next;  // capture of each group
+	Xorg &_xorg;
+	std::vector<Monitor> &_monitors;
+	Sync &_ev;
+	bool _quit;
+};
+
 struct Brightness_Manager
 {
 	Brightness_Manager(Xorg&);
 	void start();
 	void stop();
+	void set_idle(bool);
+	void capture_now(int scr_idx);
 	std::vector<Sysfs::Backlight> backlights;
 	std::vector<Sysfs::ALS>       als;
 	std::vector<std::thread>      threads;
 	std::vector<Monitor>          monitors;
 	Sync als_stop;
-	Sync als_ev;
+	Sync capture_ev;
+	Capture_Engine engine;
+	bool idle;
 };
 
-void als_capture_loop(Sysfs::ALS&, Sync&, Sync&);
+void als_capture_loop(Sysfs::ALS&, Sync&, Sync&, const bool &idle);
 void als_capture_stop(Sync&);
 void als_notify(Sync&);
-int  als_await(Sysfs::ALS&, Sync&);
 
 class Gamma_Refresh
 {
@@ -135,9 +199,30 @@ public:
 	Gamma_Refresh();
 	void loop(Xorg&);
 	void stop();
+	void idle(bool);
+private:
+	std::condition_variable _cv;
+	std::mutex _mtx; // guards _quit and _idle, waited on with _cv
+	bool _quit;
+	bool _idle;
+};
+
+/**
+ * Pauses captures, the ALS poller, gamma refreshes and temperature
+ * animations while the display is off, or nothing was input for
+ * idle_timeout seconds. Everything is caught up when the user is back. */
+class Idle_Watch
+{
+public:
+	Idle_Watch();
+	void loop(Xorg&, Brightness_Manager&, Temp_Manager&, Gamma_Refresh&);
+	void stop();
 private:
+	void set(bool idle, Brightness_Manager&, Temp_Manager&, Gamma_Refresh&);
 	std::condition_variable _cv;
+	std::mutex _mtx; // guards _quit, waited on with _cv
 	bool _quit;
+	bool _idle;
 };
 
 }
@@ -21,27 +21,15 @@
 #include "../common/defs.h"
 #include "../common/utils.h"
 
+#include <algorithm>
+#include <cstring>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <syslog.h>
 
-XLib::XLib()
-{
-	if (XInitThreads() == 0) {
-		syslog(LOG_ERR, "XInitThreads failed");
-		exit(1);
-	}
-	if (!(dsp = XOpenDisplay(nullptr))) {
-		syslog(LOG_ERR, "XOpenDisplay failed");
-		exit(1);
-	}
-};
-
-XLib::~XLib()
-{
-	XCloseDisplay(dsp);
-}
-
 XCB::XCB()
     : conn(xcb_connect(nullptr, &pref_screen))
 {
@@ -67,6 +55,39 @@ XCB::~XCB()
 
 Xorg::Xorg()
 {
+	/**
+	 * Segments and fds can only be shared over a local socket. Nested
+	 * servers and containers may still fail to attach them, so a pixel
+	 * is captured to make sure. */
+	const xcb_query_extension_reply_t *shm_ext = xcb_get_extension_data(xcb.conn, &xcb_shm_id);
+	sockaddr addr {};
+	socklen_t addr_len = sizeof(addr);
+	const bool local = getsockname(xcb_get_file_descriptor(xcb.conn), &addr, &addr_len) == 0
+	    && addr.sa_family == AF_UNIX;
+	has_shm = shm_ext && shm_ext->present && local;
+
+	// Passing memfds needs MIT-SHM 1.2
+	shm_fd_passing = false;
+	if (has_shm) {
+		auto shm_ver_ck  = xcb_shm_query_version(xcb.conn);
+		auto shm_ver_rpl = xcb_shm_query_version_reply(xcb.conn, shm_ver_ck, nullptr);
+		if (shm_ver_rpl) {
+			shm_fd_passing = shm_ver_rpl->major_version > 1
+			    || (shm_ver_rpl->major_version == 1 && shm_ver_rpl->minor_version >= 2);
+			free(shm_ver_rpl);
+		}
+		has_shm = shm_probe();
+	}
+	if (!has_shm)
+		syslog(LOG_WARNING, "MIT-SHM not usable, screenshots are sampled from small patches");
+
+	format = root_format();
+	const Rgb_kernels kernels = rgb_kernels(format);
+	if (!kernels.sum) {
+		syslog(LOG_ERR, "unsupported pixel format (%d bpp, masks %x %x %x), screenshot brightness disabled",
+		       format.bytes_per_pixel * 8, format.masks[0], format.masks[1], format.masks[2]);
+	}
+
 	auto scr_ck   = xcb_randr_get_screen_resources(xcb.conn, xcb.screen->root);
 	auto *scr_rpl = xcb_randr_get_screen_resources_reply(xcb.conn, scr_ck, 0);
 	xcb_randr_crtc_t *crtcs = xcb_randr_get_screen_resources_crtcs(scr_rpl);
@@ -77,7 +98,7 @@ Xorg::Xorg()
 		o.info            = xcb_randr_get_crtc_info_reply(xcb.conn, crtc_info_ck, nullptr);
 		if (o.info->num_outputs == 0)
 			continue;
-		outputs.push_back(o);
+		outputs.push_back(std::move(o));
 	}
 	free(scr_rpl);
 
@@ -91,40 +112,1265 @@ Xorg::Xorg()
 			exit(1);
 		}
 		o.ramp_sz = gamma_rpl->size;
-		o.ramps.resize(3 * size_t(o.ramp_sz) * sizeof(uint16_t));
 		free(gamma_rpl);
 
-		// couldn't make the following work when refactored into a function
-		o.image = XShmCreateImage(
-		   xlib.dsp,
-		   DefaultVisual(xlib.dsp, DefaultScreen(xlib.dsp)),
-		   DefaultDepth(xlib.dsp, DefaultScreen(xlib.dsp)),
-		   ZPixmap,
-		   nullptr,
-		   &o.shminfo,
-		   o.info->width,
-		   o.info->height
-		);
-		o.image_len     = o.info->width * o.info->height * 4;
-		o.shminfo.shmid = shmget(IPC_PRIVATE, o.image_len, IPC_CREAT | 0600);
-		void *shm       = shmat(o.shminfo.shmid, nullptr, SHM_RDONLY);
-		if (shm == reinterpret_cast<void*>(-1)) {
-			syslog(LOG_ERR, "shmat failed");
-			exit(1);
+		o.kernels    = kernels;
+		o.image_len  = 0;
+		o.box        = { 0, 0, 0, 0 };
+		o.sample_err = -1;
+		o.fingerprint = 0;
+		o.stats       = {0, 0};
+		o.shm_used  = std::chrono::steady_clock::now();
+		o.shm_front    = 0;
+		o.has_pending  = false;
+		o.capture_lead = std::chrono::microseconds(0);
+
+		o.tile_cols   = (o.info->width + tile_sz - 1) / tile_sz;
+		o.tile_rows   = (o.info->height + tile_sz - 1) / tile_sz;
+		o.tiles       = std::vector<Tile>(size_t(o.tile_cols) * o.tile_rows);
+		o.stat    = LUMA_MEAN;
+		o.active_only = false;
+		o.brt     = 0;
+		o.tile_len  = 0;
+		o.strip_len = 0;
+		o.strips    = 0;
+		o.strip_h   = 0;
+		region_compile(o); // sets up the tiles and pieces
+	}
+
+	damage_init();
+	render_init();
+	idle_init();
+	events_init();
+}
+
+/**
+ * Layout of the images captured from the root window,
+ * from the pixmap format of its depth and its visual. */
+Pixel_format Xorg::root_format()
+{
+	const xcb_setup_t *setup = xcb_get_setup(xcb.conn);
+	Pixel_format f {4, {0x00ff0000, 0x0000ff00, 0x000000ff}, false};
+	scanline_pad = 32;
+
+	for (auto it = xcb_setup_pixmap_formats_iterator(setup); it.rem; xcb_format_next(&it)) {
+		if (it.data->depth == xcb.screen->root_depth) {
+			f.bytes_per_pixel = it.data->bits_per_pixel / 8;
+			scanline_pad      = it.data->scanline_pad;
+		}
+	}
+
+	for (auto d = xcb_screen_allowed_depths_iterator(xcb.screen); d.rem; xcb_depth_next(&d)) {
+		for (auto v = xcb_depth_visuals_iterator(d.data); v.rem; xcb_visualtype_next(&v)) {
+			if (v.data->visual_id == xcb.screen->root_visual) {
+				f.masks[0] = v.data->red_mask;
+				f.masks[1] = v.data->green_mask;
+				f.masks[2] = v.data->blue_mask;
+			}
+		}
+	}
+
+	f.msb_first = setup->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST;
+	return f;
+}
+
+// Bytes per row of a w pixels wide image
+int Xorg::pitch(int w) const
+{
+	const int bits = w * format.bytes_per_pixel * 8;
+	return (bits + scanline_pad - 1) / scanline_pad * scanline_pad / 8;
+}
+
+Shm::Shm() : _conn(nullptr), _seg(0), _data(nullptr), _len(0), _sysv(false)
+{
+}
+
+Shm::Shm(xcb_connection_t *conn, size_t len, bool fd_passing)
+    : _conn(conn),
+      _seg(xcb_generate_id(conn)),
+      _data(nullptr),
+      _len(len),
+      _sysv(!fd_passing)
+{
+	if (_sysv) {
+		map_sysv();
+		return;
+	}
+
+	/**
+	 * Huge pages cut TLB misses while sampling large captures.
+	 * hugetlbfs pages must be reserved by the admin, otherwise
+	 * transparent huge pages are requested for regular shmem. */
+	if (len >= hugepage_sz) {
+		_len = (len + hugepage_sz - 1) / hugepage_sz * hugepage_sz;
+		if (map_memfd(MFD_HUGETLB))
+			return;
+		_len = len;
+	}
+
+	if (!map_memfd(0)) {
+		syslog(LOG_ERR, "memfd capture buffer failed, errno %d", errno);
+		return;
+	}
+
+	if (len >= hugepage_sz)
+		madvise(_data, _len, MADV_HUGEPAGE);
+}
+
+bool Shm::map_memfd(int flags)
+{
+	const int fd = memfd_create("gummy-capture", MFD_CLOEXEC | flags);
+	if (fd == -1)
+		return false;
+
+	void *addr = MAP_FAILED;
+	if (ftruncate(fd, _len) == 0)
+		addr = mmap(nullptr, _len, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	_data = reinterpret_cast<uint8_t*>(addr);
+	// xcb closes the fd once it's sent
+	xcb_shm_attach_fd(_conn, _seg, fd, 0);
+	return true;
+}
+
+void Shm::map_sysv()
+{
+	const int shmid = shmget(IPC_PRIVATE, _len, IPC_CREAT | 0600);
+	void *addr      = shmat(shmid, nullptr, SHM_RDONLY);
+	if (addr == reinterpret_cast<void*>(-1)) {
+		syslog(LOG_ERR, "shmat failed");
+		if (shmid != -1)
+			shmctl(shmid, IPC_RMID, nullptr);
+		return;
+	}
+	_data = reinterpret_cast<uint8_t*>(addr);
+
+	// The segment is destroyed once detached by both, so the server must attach it first
+	xcb_generic_error_t *e = xcb_request_check(_conn, xcb_shm_attach_checked(_conn, _seg, shmid, 0));
+	if (e) {
+		syslog(LOG_ERR, "xcb_shm_attach error: %d", int(e->error_code));
+		free(e);
+		shmdt(_data);
+		_data = nullptr;
+	}
+	shmctl(shmid, IPC_RMID, nullptr);
+}
+
+Shm::Shm(Shm &&o)
+    : _conn(o._conn),
+      _seg(o._seg),
+      _data(o._data),
+      _len(o._len),
+      _sysv(o._sysv)
+{
+	o._data = nullptr;
+}
+
+Shm &Shm::operator=(Shm &&o)
+{
+	if (this != &o) {
+		release();
+		_conn   = o._conn;
+		_seg    = o._seg;
+		_data   = o._data;
+		_len    = o._len;
+		_sysv   = o._sysv;
+		o._data = nullptr;
+	}
+	return *this;
+}
+
+Shm::~Shm()
+{
+	release();
+}
+
+void Shm::release()
+{
+	if (!_data)
+		return;
+	xcb_shm_detach(_conn, _seg);
+	if (_sysv)
+		shmdt(_data);
+	else
+		munmap(_data, _len);
+	_data = nullptr;
+}
+
+xcb_shm_seg_t Shm::seg() const
+{
+	return _seg;
+}
+
+uint8_t *Shm::data() const
+{
+	return _data;
+}
+
+size_t Shm::len() const
+{
+	return _len;
+}
+
+/**
+ * Capture buffers are only allocated for screens being captured, and
+ * only replaced when too small: a region shrinking keeps its segments.
+ * Must be called with shm_mtx held. */
+void Xorg::shm_alloc(Output &o, Shm &shm, size_t len)
+{
+	if (shm.data() && shm.len() < len)
+		shm = Shm();
+	if (!shm.data()) {
+		shm = Shm(xcb.conn, len, shm_fd_passing);
+		xcb_flush(xcb.conn);
+		// The capture fails, the next ones use patches
+		if (!shm.data()) {
+			syslog(LOG_WARNING, "MIT-SHM allocation failed, screenshots are sampled from small patches");
+			has_shm = false;
+		}
+	}
+	o.shm_used = std::chrono::steady_clock::now();
+}
+
+// Whether a pixel can be captured through a segment
+bool Xorg::shm_probe()
+{
+	Shm shm(xcb.conn, 4096, shm_fd_passing);
+	if (!shm.data())
+		return false;
+	auto ck  = xcb_shm_get_image(xcb.conn, xcb.screen->root, 0, 0, 1, 1,
+	                             ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, shm.seg(), 0);
+	xcb_generic_error_t *e = nullptr;
+	auto rpl = xcb_shm_get_image_reply(xcb.conn, ck, &e);
+	const bool ok = rpl && !e;
+	free(rpl);
+	free(e);
+	return ok;
+}
+
+/**
+ * Frees the buffers of screens that left screenshot mode
+ * longer than brt_auto_buffer_timeout seconds ago. */
+void Xorg::release_idle_buffers()
+{
+	using namespace std::chrono;
+	const auto now = steady_clock::now();
+
+	std::lock_guard lk(shm_mtx);
+	bool released = false;
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		Output &o = outputs[i];
+		if (cfg.screens[i].brt_mode == SCREENSHOT)
+			continue;
+		if (now - o.shm_used < seconds(cfg.brt_auto_buffer_timeout))
+			continue;
+		if (!o.shm[0].data() && !o.shm[1].data() && !o.tile_shm.data() && !o.strip_shm.data())
+			continue;
+		shm_discard(o);
+		o.shm[0]    = Shm();
+		o.shm[1]    = Shm();
+		o.tile_shm  = Shm();
+		o.strip_shm = Shm();
+		released    = true;
+	}
+	if (released)
+		xcb_flush(xcb.conn);
+}
+
+/**
+ * Full frames are double buffered: the next frame can be requested into
+ * the back buffer ahead of time, while the front one is still read.
+ * Must be called with shm_mtx held. */
+void Xorg::shm_request_next(Output &o)
+{
+	Shm &back = o.shm[o.shm_front ^ 1];
+	shm_alloc(o, back, o.image_len);
+	o.shm_pending.clear();
+	shm_request(o, back, 0, o.pieces, o.shm_pending);
+	o.has_pending   = true;
+	o.pending_since = std::chrono::steady_clock::now();
+}
+
+/**
+ * Waits for the pending frame and makes it the front one.
+ * Any time spent waiting means it should have been requested
+ * earlier, so it's added to the lead. Otherwise the lead decays.
+ * Must be called with shm_mtx held. */
+bool Xorg::shm_collect(Output &o)
+{
+	using namespace std::chrono;
+	const auto t0   = steady_clock::now();
+	const bool ok   = shm_reply(o.shm_pending);
+	const auto wait = duration_cast<microseconds>(steady_clock::now() - t0);
+	o.shm_pending.clear();
+	o.has_pending   = false;
+
+	if (wait > milliseconds(1))
+		o.capture_lead = std::min(o.capture_lead + wait, duration_cast<microseconds>(milliseconds(500)));
+	else
+		o.capture_lead -= o.capture_lead / 16;
+
+	if (ok)
+		o.shm_front ^= 1;
+	return ok;
+}
+
+/**
+ * Queues the request for the next full frame of a screen, to be collected
+ * by get_screen_brightness(). Does nothing for the other capture modes,
+ * which either depend on damage known only at capture time or are
+ * cheap enough to be synchronous. */
+void Xorg::capture_request(int scr_idx)
+{
+	if (!pipelined(scr_idx))
+		return;
+	std::lock_guard lk(shm_mtx);
+	Output &o = outputs[scr_idx];
+	if (o.has_pending)
+		return;
+	shm_request_next(o);
+}
+
+// Position and size of a screen on the root window
+Rect Xorg::area(int scr_idx) const
+{
+	const auto *info = outputs[scr_idx].info;
+	return { info->x, info->y, info->width, info->height };
+}
+
+Capture_stats Xorg::stats(int scr_idx) const
+{
+	return outputs[scr_idx].stats;
+}
+
+// Sends the requests queued by capture_request()
+void Xorg::flush()
+{
+	xcb_flush(xcb.conn);
+}
+
+std::chrono::microseconds Xorg::capture_lead(int scr_idx) const
+{
+	return outputs[scr_idx].capture_lead;
+}
+
+Capture_backend Xorg::backend(int scr_idx) const
+{
+	const Capture_backend b = cfg.screens[scr_idx].brt_auto_capture;
+	if (b == CAPTURE_RENDER && has_render)
+		return b;
+	if (!has_shm)
+		return CAPTURE_PATCHES;
+	if (b == CAPTURE_RENDER)
+		return CAPTURE_SHM;
+	return b;
+}
+
+bool Xorg::pipelined(int scr_idx) const
+{
+	return backend(scr_idx) == CAPTURE_SHM && !(has_damage && cfg.screens[scr_idx].brt_auto_damage);
+}
+
+/**
+ * Asks the server to copy a rectangle of the output into the segment.
+ * The reply only tells when the copy is done, so several requests
+ * can be in flight before collecting them. */
+xcb_shm_get_image_cookie_t Xorg::shm_request(const Output &o, const Shm &shm, uint32_t offset, int x, int y, int w, int h)
+{
+	return xcb_shm_get_image(xcb.conn, xcb.screen->root,
+	                         o.info->x + x, o.info->y + y, w, h,
+	                         ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
+	                         shm.seg(), offset);
+}
+
+bool Xorg::shm_reply(xcb_shm_get_image_cookie_t ck)
+{
+	xcb_generic_error_t *e = nullptr;
+	auto *rpl = xcb_shm_get_image_reply(xcb.conn, ck, &e);
+	free(rpl);
+	if (e) {
+		syslog(LOG_ERR, "xcb_shm_get_image error: %d", int(e->error_code));
+		free(e);
+		return false;
+	}
+	return true;
+}
+
+// Waits for every reply, even after an error, so none is left behind
+bool Xorg::shm_reply(const std::vector<xcb_shm_get_image_cookie_t> &ck)
+{
+	bool ok = true;
+	for (auto c : ck)
+		ok = shm_reply(c) && ok;
+	return ok;
+}
+
+// Requests each piece, at `offset` bytes into the segment
+void Xorg::shm_request(const Output &o, const Shm &shm, uint32_t offset, const std::vector<Piece> &pieces, std::vector<xcb_shm_get_image_cookie_t> &ck)
+{
+	for (const Piece &p : pieces)
+		ck.push_back(shm_request(o, shm, offset + p.offset, p.r.x, p.r.y, p.r.w, p.r.h));
+}
+
+// Drops the frame pending in the back buffer. Must be called with shm_mtx held.
+void Xorg::shm_discard(Output &o)
+{
+	if (!o.has_pending)
+		return;
+	for (auto c : o.shm_pending)
+		xcb_discard_reply(xcb.conn, c.sequence);
+	o.shm_pending.clear();
+	o.has_pending = false;
+}
+
+/**
+ * Lays the rectangles out one after the other, as pieces of a segment.
+ * Returns the bytes they take. */
+uint64_t Xorg::pieces_layout(std::vector<Piece> &pieces, const std::vector<Rect> &rects) const
+{
+	pieces.clear();
+	uint64_t len = 0;
+	for (const Rect &r : rects) {
+		pieces.push_back({ r, uint32_t(len), pitch(r.w) });
+		len += uint64_t(pieces.back().pitch) * r.h;
+	}
+	return len;
+}
+
+// Piece holding a pixel, null if none does
+static const Piece *piece_at(const std::vector<Piece> &pieces, int x, int y)
+{
+	// Sorted by band, bands don't overlap
+	auto it = std::partition_point(pieces.begin(), pieces.end(), [y] (const Piece &p) {
+		return p.r.y + p.r.h <= y;
+	});
+	for (; it != pieces.end() && it->r.y <= y; ++it) {
+		if (x >= it->r.x && x < it->r.x + it->r.w)
+			return &*it;
+	}
+	return nullptr;
+}
+
+void Xorg::damage_init()
+{
+	has_damage = false;
+
+	const xcb_query_extension_reply_t *ext = xcb_get_extension_data(xcb.conn, &xcb_damage_id);
+	if (!ext || !ext->present) {
+		syslog(LOG_WARNING, "XDamage not available, capturing on every poll");
+		return;
+	}
+
+	auto ver_ck  = xcb_damage_query_version(xcb.conn, XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION);
+	auto ver_rpl = xcb_damage_query_version_reply(xcb.conn, ver_ck, nullptr);
+	if (!ver_rpl) {
+		syslog(LOG_WARNING, "xcb_damage_query_version failed");
+		return;
+	}
+	free(ver_rpl);
+
+	/**
+	 * Delta rectangles are reported only when the damaged region grows,
+	 * so the region is cleared each time the events are consumed. */
+	damage         = xcb_generate_id(xcb.conn);
+	damage_ev_base = ext->first_event;
+	xcb_damage_create(xcb.conn, damage, xcb.screen->root, XCB_DAMAGE_REPORT_LEVEL_DELTA_RECTANGLES);
+	xcb_flush(xcb.conn);
+	has_damage = true;
+}
+
+// Marks the tiles under a damaged area dirty
+void Xorg::damage_mark(const xcb_damage_notify_event_t *d)
+{
+	std::lock_guard lk(damage_mtx);
+	for (auto &o : outputs) {
+		// damaged area relative to the CRTC
+		const int x0 = std::max(d->area.x - o.info->x, 0);
+		const int y0 = std::max(d->area.y - o.info->y, 0);
+		const int x1 = std::min(d->area.x + d->area.width - o.info->x, int(o.info->width));
+		const int y1 = std::min(d->area.y + d->area.height - o.info->y, int(o.info->height));
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+		o.damaged = true;
+		for (int ty = y0 / tile_sz; ty <= (y1 - 1) / tile_sz; ++ty) {
+			for (int tx = x0 / tile_sz; tx <= (x1 - 1) / tile_sz; ++tx) {
+				Tile &t = o.tiles[ty * o.tile_cols + tx];
+				if (!t.dirty && !t.spans.empty()) {
+					t.dirty = true;
+					++o.dirty_tiles;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Root window properties changed on focus and workspace switches,
+ * and an unmapped window to send ourselves the quit message. */
+void Xorg::events_init()
+{
+	const auto intern = [this] (const char *name) {
+		auto ck  = xcb_intern_atom(xcb.conn, 0, strlen(name), name);
+		auto rpl = xcb_intern_atom_reply(xcb.conn, ck, nullptr);
+		if (!rpl)
+			return xcb_atom_t(XCB_NONE);
+		const xcb_atom_t ret = rpl->atom;
+		free(rpl);
+		return ret;
+	};
+	atom_active_window   = intern("_NET_ACTIVE_WINDOW");
+	atom_current_desktop = intern("_NET_CURRENT_DESKTOP");
+	atom_quit            = intern("_GUMMY_QUIT");
+
+	const uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_change_window_attributes(xcb.conn, xcb.screen->root, XCB_CW_EVENT_MASK, &mask);
+
+	active_win  = XCB_NONE;
+	active_rect = { 0, 0, 0, 0 };
+
+	event_win = xcb_generate_id(xcb.conn);
+	xcb_create_window(xcb.conn, XCB_COPY_FROM_PARENT, event_win, xcb.screen->root,
+	                  0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
+	active_set(active_window(), false, [] (int) {});
+	xcb_flush(xcb.conn);
+}
+
+/**
+ * Handles X events until events_stop(). Damage marks tiles, while focus
+ * and workspace switches call `on_switch` for each output whose content
+ * has likely changed as a whole, so it can be captured right away. */
+void Xorg::event_loop(const std::function<void(int scr_idx)> &on_switch)
+{
+	xcb_generic_event_t *ev = xcb_wait_for_event(xcb.conn);
+	if (!ev) {
+		syslog(LOG_ERR, "X connection lost, events stopped");
+		return;
+	}
+
+	bool damaged    = false;
+	bool configured = false; // the focused window, moved or resized
+	bool quit       = false;
+	do {
+		const uint8_t type = ev->response_type & ~0x80;
+		if (has_damage && type == damage_ev_base + XCB_DAMAGE_NOTIFY) {
+			damage_mark(reinterpret_cast<xcb_damage_notify_event_t*>(ev));
+			damaged = true;
+		} else if (type == XCB_PROPERTY_NOTIFY) {
+			const auto *p = reinterpret_cast<xcb_property_notify_event_t*>(ev);
+			if (p->atom == atom_current_desktop && p->atom != XCB_NONE) {
+				for (size_t i = 0; i < outputs.size(); ++i)
+					switched(i, on_switch);
+			} else if (p->atom == atom_active_window && p->atom != XCB_NONE) {
+				active_set(active_window(), true, on_switch);
+			}
+		} else if (type == XCB_CONFIGURE_NOTIFY) {
+			const auto *c = reinterpret_cast<xcb_configure_notify_event_t*>(ev);
+			configured |= c->window == active_win;
+		} else if (type == XCB_CLIENT_MESSAGE) {
+			const auto *c = reinterpret_cast<xcb_client_message_event_t*>(ev);
+			quit = c->window == event_win && c->type == atom_quit;
+		}
+		free(ev);
+	} while ((ev = xcb_poll_for_event(xcb.conn)));
+
+	// The damaged region only grows otherwise, see damage_init()
+	if (damaged) {
+		xcb_damage_subtract(xcb.conn, damage, XCB_NONE, XCB_NONE);
+		xcb_flush(xcb.conn);
+	}
+
+	// Moving a window sends many events, only the last position matters
+	if (configured)
+		active_set(active_win, false, on_switch);
+
+	if (quit)
+		return;
+	event_loop(on_switch);
+}
+
+void Xorg::events_stop()
+{
+	xcb_client_message_event_t ev {};
+	ev.response_type = XCB_CLIENT_MESSAGE;
+	ev.format = 32;
+	ev.window = event_win;
+	ev.type   = atom_quit;
+	// With no event mask, it goes to the client that created the window
+	xcb_send_event(xcb.conn, 0, event_win, XCB_EVENT_MASK_NO_EVENT, reinterpret_cast<const char*>(&ev));
+	xcb_flush(xcb.conn);
+}
+
+/**
+ * A frame requested before the switch shows the old content,
+ * so it's dropped and the next capture fetches a new one. */
+void Xorg::switched(int scr_idx, const std::function<void(int)> &on_switch)
+{
+	{
+		std::lock_guard lk(shm_mtx);
+		shm_discard(outputs[scr_idx]);
+	}
+	on_switch(scr_idx);
+}
+
+xcb_window_t Xorg::active_window()
+{
+	auto ck  = xcb_get_property(xcb.conn, 0, xcb.screen->root, atom_active_window, XCB_ATOM_WINDOW, 0, 1);
+	auto rpl = xcb_get_property_reply(xcb.conn, ck, nullptr);
+	if (!rpl)
+		return XCB_NONE;
+	xcb_window_t ret = XCB_NONE;
+	if (xcb_get_property_value_length(rpl) >= int(sizeof(ret)))
+		ret = *static_cast<xcb_window_t*>(xcb_get_property_value(rpl));
+	free(rpl);
+	return ret;
+}
+
+// Root coordinates of a window, or an empty rect if unknown
+Rect Xorg::window_rect(xcb_window_t win)
+{
+	if (win == XCB_NONE)
+		return { 0, 0, 0, 0 };
+	auto geo_ck  = xcb_get_geometry(xcb.conn, win);
+	auto pos_ck  = xcb_translate_coordinates(xcb.conn, win, xcb.screen->root, 0, 0);
+	auto geo_rpl = xcb_get_geometry_reply(xcb.conn, geo_ck, nullptr);
+	auto pos_rpl = xcb_translate_coordinates_reply(xcb.conn, pos_ck, nullptr);
+	Rect ret { 0, 0, 0, 0 };
+	if (geo_rpl && pos_rpl)
+		ret = { pos_rpl->dst_x, pos_rpl->dst_y, geo_rpl->width, geo_rpl->height };
+	free(geo_rpl);
+	free(pos_rpl);
+	return ret;
+}
+
+/**
+ * Caches the geometry of the focused window, which is only queried again
+ * on ConfigureNotify. Outputs whose region changed, and on focus changes
+ * the ones the window is on, are woken up. */
+void Xorg::active_set(xcb_window_t win, bool focused, const std::function<void(int)> &on_switch)
+{
+	if (win != active_win) {
+		const uint32_t none = XCB_EVENT_MASK_NO_EVENT;
+		const uint32_t mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+		if (active_win != XCB_NONE)
+			xcb_change_window_attributes(xcb.conn, active_win, XCB_CW_EVENT_MASK, &none);
+		if (win != XCB_NONE)
+			xcb_change_window_attributes(xcb.conn, win, XCB_CW_EVENT_MASK, &mask);
+	}
+	const Rect rect = window_rect(win);
+
+	std::vector<int> woken;
+	{
+		std::scoped_lock lk(damage_mtx, shm_mtx);
+		active_win  = win;
+		active_rect = rect;
+		for (size_t i = 0; i < outputs.size(); ++i) {
+			Output &o = outputs[i];
+			const Rect crtc { o.info->x, o.info->y, o.info->width, o.info->height };
+			const bool on_output = rect.w == 0 || intersect(rect, crtc).w > 0;
+			if (region_apply(o) || (focused && on_output))
+				woken.push_back(i);
+		}
+	}
+	for (int i : woken)
+		switched(i, on_switch);
+}
+
+
+/**
+ * Switches an output to another luma mode or statistic. The tile sums are
+ * in the units of the old kernels, and only have a histogram for
+ * statistics other than the mean, so every tile is fetched again. */
+void Xorg::luma_set(Output &o, Luma_mode luma, Luma_stat stat)
+{
+	std::scoped_lock lk(damage_mtx, shm_mtx);
+	o.kernels = rgb_kernels(format, luma);
+	o.stat    = stat;
+	o.fingerprint = 0;
+	tiles_reset(o);
+}
+
+/**
+ * Clears the sums of every tile, marking the ones in the region dirty.
+ * Must be called with damage_mtx and shm_mtx held. */
+void Xorg::tiles_reset(Output &o)
+{
+	o.dirty_tiles = 0;
+	for (auto &t : o.tiles) {
+		t.rgb[0] = t.rgb[1] = t.rgb[2] = 0;
+		t.samples = 0;
+		std::fill(t.hist, t.hist + hist_bins, 0);
+		t.dirty = !t.spans.empty();
+		o.dirty_tiles += t.dirty;
+	}
+	o.rgb[0] = o.rgb[1] = o.rgb[2] = 0;
+	o.samples = 0;
+	std::fill(o.hist, o.hist + hist_bins, 0);
+	o.damaged = true;
+}
+
+void Xorg::set_region(int scr_idx, const Region &r)
+{
+	Output &o = outputs[scr_idx];
+	std::scoped_lock lk(damage_mtx, shm_mtx);
+	o.cfg_region = r;
+	region_apply(o);
+}
+
+void Xorg::set_active_only(int scr_idx, bool active_only)
+{
+	Output &o = outputs[scr_idx];
+	std::scoped_lock lk(damage_mtx, shm_mtx);
+	o.active_only = active_only;
+	region_apply(o);
+}
+
+/**
+ * Narrows the region down to the focused window, when it's on the output.
+ * Returns whether the region changed, compiling it if so.
+ * Must be called with damage_mtx and shm_mtx held. */
+bool Xorg::region_apply(Output &o)
+{
+	Region r = o.cfg_region;
+	const Rect crtc { o.info->x, o.info->y, o.info->width, o.info->height };
+	Rect w = intersect(active_rect, crtc);
+	if (o.active_only && w.w > 0) {
+		w.x -= crtc.x;
+		w.y -= crtc.y;
+		std::vector<Rect> include;
+		for (const Rect &i : r.include) {
+			const Rect c = intersect(i, w);
+			if (c.w > 0)
+				include.push_back(c);
+		}
+		r.include = include.empty() ? std::vector<Rect>{ w } : include;
+	}
+
+	if (r.include == o.region.include && r.exclude == o.region.exclude)
+		return false;
+	o.region = r;
+	region_compile(o);
+	return true;
+}
+
+/**
+ * Turns the region of an output into what each backend reads: the pieces
+ * full captures fetch, the spans and pieces of each tile, the rectangles
+ * composited into the RENDER picture. Pixels outside of it are never
+ * fetched nor tested again. A frame pending for other pieces is dropped,
+ * the segments are kept unless the pieces outgrow them, see shm_alloc().
+ * Must be called with damage_mtx and shm_mtx held. */
+void Xorg::region_compile(Output &o)
+{
+	const int w = o.info->width;
+	const int h = o.info->height;
+
+	const std::vector<Rect> rects = o.region.rects({ 0, 0, w, h });
+	const bool same = std::equal(rects.begin(), rects.end(), o.pieces.begin(), o.pieces.end(), [] (const Rect &r, const Piece &p) {
+		return r == p.r;
+	});
+	if (!same)
+		shm_discard(o);
+	o.box        = o.region.bounds({ 0, 0, w, h });
+	o.image_len  = pieces_layout(o.pieces, rects);
+	o.sample_err = -1; // rebuilds the offsets
+	o.fingerprint = 0; // strips may hash the same over another region
+	o.strips     = 0;  // and their pieces
+
+	o.tile_len = 0;
+	for (size_t i = 0; i < o.tiles.size(); ++i) {
+		const int x = int(i % o.tile_cols) * tile_sz;
+		const int y = int(i / o.tile_cols) * tile_sz;
+		Tile &t = o.tiles[i];
+		t.spans = sample_spans({ x, y, std::min(tile_sz, w - x), std::min(tile_sz, h - y) }, tile_sample_step, uint32_t(i) + 1, o.region);
+		const uint64_t len = pieces_layout(t.pieces, intersect(rects, bounds(t.spans)));
+		o.tile_len = std::max(o.tile_len, size_t(len));
+	}
+
+	// Rectangles are scaled outwards, in both lists
+	const auto scale = [w, h] (const Rect &r) {
+		const int x0 = r.x * render_w / w;
+		const int y0 = r.y * render_h / h;
+		const int x1 = ((r.x + r.w) * render_w + w - 1) / w;
+		const int y1 = ((r.y + r.h) * render_h + h - 1) / h;
+		return Rect{ x0, y0, x1 - x0, y1 - y0 };
+	};
+	Region scaled;
+	std::transform(o.region.include.begin(), o.region.include.end(), std::back_inserter(scaled.include), scale);
+	std::transform(o.region.exclude.begin(), o.region.exclude.end(), std::back_inserter(scaled.exclude), scale);
+	o.render_spans = scaled.spans({ 0, 0, render_w, render_h }, 1);
+	o.render_rects = scaled.rects({ 0, 0, render_w, render_h });
+
+	// A patch centered in each cell of a grid over the box
+	o.patches.clear();
+	const Rect &box = o.box;
+	const int pw = std::min(patch_sz, box.w);
+	const int ph = std::min(patch_sz, box.h);
+	for (int row = 0; row < patch_rows; ++row) {
+		for (int col = 0; col < patch_cols; ++col) {
+			const int x = box.x + (2 * col + 1) * box.w / (2 * patch_cols) - pw / 2;
+			const int y = box.y + (2 * row + 1) * box.h / (2 * patch_rows) - ph / 2;
+			const Rect r { std::clamp(x, box.x, box.x + box.w - pw), std::clamp(y, box.y, box.y + box.h - ph), pw, ph };
+			Patch p;
+			p.spans = o.region.spans(r, 1);
+			if (p.spans.empty())
+				continue;
+			p.box = bounds(p.spans);
+			o.patches.push_back(std::move(p));
+		}
+	}
+
+	tiles_reset(o);
+}
+
+// From the sums or the histogram, depending on the statistic
+static int output_brightness(const Output &o, const uint64_t rgb[3], uint64_t samples, const uint32_t hist[hist_bins])
+{
+	if (o.stat == LUMA_MEAN)
+		return calc_brightness(rgb, samples, o.kernels);
+	return calc_brightness(hist, o.stat, o.kernels);
+}
+
+/**
+ * Sums every `step`th pixel of the spans, in an image whose top left
+ * pixel is at (ox, oy). They're added to `hist` too unless the output
+ * uses the mean. Returns the amount of pixels sampled. */
+uint64_t Xorg::spans_sum(const Output &o, const uint8_t *img, int pitch, int ox, int oy, const std::vector<Span> &spans, int step, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	const int bpp = o.kernels.bytes_per_pixel;
+	uint64_t samples = 0;
+	for (const Span &s : spans) {
+		const uint8_t *px = img + (s.y - oy) * pitch + (s.x0 - ox) * bpp;
+		const int w = s.x1 - s.x0;
+		if (o.stat == LUMA_MEAN)
+			o.kernels.sum(px, uint64_t(w) * bpp, uint64_t(step) * bpp, rgb);
+		else
+			o.kernels.hist(px, uint64_t(w) * bpp, uint64_t(step) * bpp, rgb, hist);
+		samples += (w + step - 1) / step;
+	}
+	return samples;
+}
+
+/**
+ * Sums every `step`th pixel of the spans, which the pieces fetched into
+ * `img` cover. Returns the amount of pixels sampled, see spans_sum(). */
+uint64_t Xorg::pieces_sum(const Output &o, const uint8_t *img, const std::vector<Piece> &pieces, const std::vector<Span> &spans, int step, uint64_t rgb[3], uint32_t hist[hist_bins])
+{
+	const int bpp = o.kernels.bytes_per_pixel;
+	uint64_t samples = 0;
+	for (const Span &s : spans) {
+		// Spans are cut from the same region, so never straddle pieces
+		const Piece *p = piece_at(pieces, s.x0, s.y);
+		if (!p)
+			continue;
+		const uint8_t *px = img + p->offset + (s.y - p->r.y) * p->pitch + (s.x0 - p->r.x) * bpp;
+		const int w = s.x1 - s.x0;
+		if (o.stat == LUMA_MEAN)
+			o.kernels.sum(px, uint64_t(w) * bpp, uint64_t(step) * bpp, rgb);
+		else
+			o.kernels.hist(px, uint64_t(w) * bpp, uint64_t(step) * bpp, rgb, hist);
+		samples += (w + step - 1) / step;
+	}
+	return samples;
+}
+
+/**
+ * Samples about as many pixels of the pieces as the error of the output
+ * needs, see sample_offsets(). The offsets are into the pieces, sorted. */
+std::vector<uint32_t> Xorg::pieces_offsets(const Output &o)
+{
+	const int bpp = o.kernels.bytes_per_pixel;
+	const int box_pitch = pitch(o.box.w);
+	std::vector<uint32_t> offsets = sample_offsets(o.box, box_pitch, bpp, samples_for_error(o.sample_err), o.crtc, o.region);
+
+	size_t n = 0;
+	for (uint32_t off : offsets) {
+		const int x = o.box.x + int(off % box_pitch) / bpp;
+		const int y = o.box.y + int(off / box_pitch);
+		const Piece *p = piece_at(o.pieces, x, y);
+		if (!p)
+			continue;
+		offsets[n++] = p->offset + (y - p->r.y) * p->pitch + (x - p->r.x) * bpp;
+	}
+	offsets.resize(n);
+	std::sort(offsets.begin(), offsets.end());
+	return offsets;
+}
+
+/**
+ * Replaces the sums of a tile with the ones sampled from its spans,
+ * in an image its pieces were fetched into. */
+void Xorg::tile_sum(Output &o, Tile &t, const uint8_t *img, const std::vector<Piece> &pieces)
+{
+	for (int i = 0; i < 3; ++i)
+		o.rgb[i] -= t.rgb[i];
+	for (int i = 0; i < hist_bins; ++i)
+		o.hist[i] -= t.hist[i];
+	o.samples -= t.samples;
+
+	t.rgb[0] = t.rgb[1] = t.rgb[2] = 0;
+	std::fill(t.hist, t.hist + hist_bins, 0);
+	t.samples = pieces_sum(o, img, pieces, t.spans, tile_sample_step, t.rgb, t.hist);
+
+	for (int i = 0; i < 3; ++i)
+		o.rgb[i] += t.rgb[i];
+	for (int i = 0; i < hist_bins; ++i)
+		o.hist[i] += t.hist[i];
+	o.samples += t.samples;
+}
+
+/**
+ * Fetches the dirty tiles and updates the running sums of the output.
+ * Past a certain amount of tiles, a single full capture is cheaper than
+ * a round trip for each one. */
+int Xorg::tiles_update(Output &o)
+{
+	std::vector<int> dirty;
+	{
+		std::lock_guard lk(damage_mtx);
+		if (o.dirty_tiles == 0)
+			return o.brt;
+		dirty.reserve(o.dirty_tiles);
+		for (size_t i = 0; i < o.tiles.size(); ++i) {
+			if (o.tiles[i].dirty) {
+				o.tiles[i].dirty = false;
+				dirty.push_back(int(i));
+			}
+		}
+		o.dirty_tiles = 0;
+		o.damaged     = false;
+	}
+
+	// Tiles that couldn't be fetched, marked dirty again
+	std::vector<int> failed;
+
+	std::unique_lock lk(shm_mtx);
+	if (o.pieces.empty()) {
+		// Excluded entirely, the tiles were reset to nothing
+	} else if (dirty.size() > o.tiles.size() / 8) {
+		shm_alloc(o, o.shm[o.shm_front], o.image_len);
+		const Shm &front = o.shm[o.shm_front];
+		std::vector<xcb_shm_get_image_cookie_t> ck;
+		shm_request(o, front, 0, o.pieces, ck);
+		if (shm_reply(ck)) {
+			for (int i : dirty)
+				tile_sum(o, o.tiles[i], front.data(), o.pieces);
+		} else {
+			failed = std::move(dirty);
+		}
+	} else {
+		// Only the pieces of a tile are fetched, at most tile_len bytes
+		shm_alloc(o, o.tile_shm, tile_batch * o.tile_len);
+		for (size_t b = 0; b < dirty.size(); b += tile_batch) {
+			const size_t n = std::min(dirty.size() - b, size_t(tile_batch));
+			std::vector<xcb_shm_get_image_cookie_t> ck[tile_batch];
+
+			for (size_t j = 0; j < n; ++j)
+				shm_request(o, o.tile_shm, uint32_t(j * o.tile_len), o.tiles[dirty[b + j]].pieces, ck[j]);
+
+			for (size_t j = 0; j < n; ++j) {
+				if (!shm_reply(ck[j])) {
+					failed.push_back(dirty[b + j]);
+					continue;
+				}
+				Tile &t = o.tiles[dirty[b + j]];
+				tile_sum(o, t, o.tile_shm.data() + j * o.tile_len, t.pieces);
+			}
+		}
+	}
+
+	if (o.samples > 0)
+		o.brt = output_brightness(o, o.rgb, o.samples, o.hist);
+	const int brt = o.brt;
+	lk.unlock();
+
+	if (!failed.empty()) {
+		std::lock_guard dlk(damage_mtx);
+		for (int i : failed) {
+			if (!o.tiles[i].dirty) {
+				o.tiles[i].dirty = true;
+				++o.dirty_tiles;
+			}
+		}
+	}
+	return brt;
+}
+
+void Xorg::render_init()
+{
+	has_render = false;
+
+	const xcb_query_extension_reply_t *ext = xcb_get_extension_data(xcb.conn, &xcb_render_id);
+	if (!ext || !ext->present) {
+		syslog(LOG_WARNING, "RENDER not available, using full resolution captures");
+		return;
+	}
+
+	// Transforms and filters need 0.6
+	auto ver_ck  = xcb_render_query_version(xcb.conn, XCB_RENDER_MAJOR_VERSION, XCB_RENDER_MINOR_VERSION);
+	auto ver_rpl = xcb_render_query_version_reply(xcb.conn, ver_ck, nullptr);
+	if (!ver_rpl)
+		return;
+	const bool supported = ver_rpl->major_version > 0 || ver_rpl->minor_version >= 6;
+	free(ver_rpl);
+	if (!supported) {
+		syslog(LOG_WARNING, "RENDER version too old, using full resolution captures");
+		return;
+	}
+
+	auto fmt_ck  = xcb_render_query_pict_formats(xcb.conn);
+	auto fmt_rpl = xcb_render_query_pict_formats_reply(xcb.conn, fmt_ck, nullptr);
+	if (!fmt_rpl)
+		return;
+
+	xcb_render_pictformat_t fmt = XCB_NONE;
+	for (auto s = xcb_render_query_pict_formats_screens_iterator(fmt_rpl); s.rem; xcb_render_pictscreen_next(&s)) {
+		for (auto d = xcb_render_pictscreen_depths_iterator(s.data); d.rem; xcb_render_pictdepth_next(&d)) {
+			for (auto v = xcb_render_pictdepth_visuals_iterator(d.data); v.rem; xcb_render_pictvisual_next(&v)) {
+				if (v.data->visual == xcb.screen->root_visual)
+					fmt = v.data->format;
+			}
 		}
-		o.shminfo.shmaddr  = o.image->data = reinterpret_cast<char*>(shm);
-		o.shminfo.readOnly = False;
-		XShmAttach(xlib.dsp, &o.shminfo);
 	}
+	free(fmt_rpl);
+	if (fmt == XCB_NONE)
+		return;
+
+	const auto fixed = [] (double d) { return xcb_render_fixed_t(d * 65536); };
+	const char filter[] = "bilinear";
+	const uint32_t include_inferiors = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+
+	for (auto &o : outputs) {
+		o.render_pixmap = xcb_generate_id(xcb.conn);
+		o.render_src    = xcb_generate_id(xcb.conn);
+		o.render_dst    = xcb_generate_id(xcb.conn);
+
+		xcb_create_pixmap(xcb.conn, xcb.screen->root_depth, o.render_pixmap, xcb.screen->root, render_w, render_h);
+		xcb_render_create_picture(xcb.conn, o.render_dst, o.render_pixmap, fmt, 0, nullptr);
+		xcb_render_create_picture(xcb.conn, o.render_src, xcb.screen->root, fmt, XCB_RENDER_CP_SUBWINDOW_MODE, &include_inferiors);
+
+		// Maps the destination picture onto the CRTC
+		const xcb_render_transform_t t {
+			fixed(double(o.info->width) / render_w), 0, fixed(o.info->x),
+			0, fixed(double(o.info->height) / render_h), fixed(o.info->y),
+			0, 0, fixed(1)
+		};
+		xcb_render_set_picture_transform(xcb.conn, o.render_src, t);
+		xcb_render_set_picture_filter(xcb.conn, o.render_src, sizeof(filter) - 1, filter, 0, nullptr);
+	}
+	xcb_flush(xcb.conn);
+
+	has_render = true;
+}
+
+/**
+ * The server scales the CRTC down to a render_w x render_h pixmap,
+ * so only that is sent back. Only the rectangles of the region are
+ * composited, the rest of the pixmap is never read. */
+int Xorg::render_capture(Output &o)
+{
+	if (o.render_rects.empty())
+		return o.brt;
+	for (const Rect &r : o.render_rects) {
+		xcb_render_composite(xcb.conn, XCB_RENDER_PICT_OP_SRC,
+		                     o.render_src, XCB_NONE, o.render_dst,
+		                     r.x, r.y, 0, 0, r.x, r.y, r.w, r.h);
+	}
+
+	auto img_ck  = xcb_get_image(xcb.conn, XCB_IMAGE_FORMAT_Z_PIXMAP, o.render_pixmap, 0, 0, render_w, render_h, ~0);
+	auto img_rpl = xcb_get_image_reply(xcb.conn, img_ck, nullptr);
+	if (!img_rpl) {
+		syslog(LOG_ERR, "xcb_get_image failed");
+		return o.brt;
+	}
+
+	uint64_t rgb[3] {};
+	uint32_t hist[hist_bins] {};
+	{
+		std::lock_guard lk(shm_mtx);
+		const uint64_t n = spans_sum(o, xcb_get_image_data(img_rpl), pitch(render_w), 0, 0, o.render_spans, 1, rgb, hist);
+		// Excludes scaled outwards can cover every pixel
+		if (n > 0)
+			o.brt = output_brightness(o, rgb, n, hist);
+	}
+	free(img_rpl);
+	return o.brt;
+}
+
+/**
+ * Lays out the pieces of `strips` bands of `strip_h` rows, evenly spread
+ * down the box of the output, and the spans inside them. Kept until the
+ * region or the strip settings change. */
+void Xorg::strips_compile(Output &o, int strips, int strip_h)
+{
+	const Rect &box = o.box;
+	std::vector<Rect> pieces_rects(o.pieces.size());
+	std::transform(o.pieces.begin(), o.pieces.end(), pieces_rects.begin(), [] (const Piece &p) {
+		return p.r;
+	});
+
+	std::vector<Rect> rects;
+	o.strip_spans.clear();
+	for (int i = 0; i < strips; ++i) {
+		const int y = box.y + (2 * i + 1) * box.h / (2 * strips) - strip_h / 2;
+		const Rect strip { box.x, std::clamp(y, box.y, box.y + box.h - strip_h), box.w, strip_h };
+		const auto r = intersect(pieces_rects, strip);
+		rects.insert(rects.end(), r.begin(), r.end());
+		const auto spans = o.region.spans(strip, 1);
+		o.strip_spans.insert(o.strip_spans.end(), spans.begin(), spans.end());
+	}
+	o.strip_len = pieces_layout(o.strip_pieces, rects);
+	o.strips    = strips;
+	o.strip_h   = strip_h;
+}
+
+/**
+ * Reads the region inside `strips` bands of `strip_h` rows into one small
+ * segment, see strips_compile(). */
+int Xorg::strips_capture(Output &o, int strips, int strip_h)
+{
+	std::lock_guard lk(shm_mtx);
+	strips  = std::clamp(strips, 1, std::max(o.box.h, 1));
+	strip_h = std::clamp(strip_h, 1, std::max(o.box.h / strips, 1));
+	if (strips != o.strips || strip_h != o.strip_h)
+		strips_compile(o, strips, strip_h);
+	if (o.strip_pieces.empty())
+		return o.brt;
+
+	shm_alloc(o, o.strip_shm, o.strip_len);
+	std::vector<xcb_shm_get_image_cookie_t> ck;
+	shm_request(o, o.strip_shm, 0, o.strip_pieces, ck);
+	if (!shm_reply(ck))
+		return o.brt;
+
+	const int bpp = o.kernels.bytes_per_pixel;
+	const uint64_t px_count = o.strip_len / bpp;
+	const uint64_t fp = fingerprint(o.strip_shm.data(), o.strip_len,
+	                                std::max<uint64_t>(px_count / fingerprint_samples, 1) * bpp, bpp);
+	if (fp == o.fingerprint) {
+		++o.stats.fingerprint_hits;
+		return o.brt;
+	}
+	++o.stats.fingerprint_misses;
+	o.fingerprint = fp;
+
+	uint64_t rgb[3] {};
+	uint32_t hist[hist_bins] {};
+	const uint64_t n = pieces_sum(o, o.strip_shm.data(), o.strip_pieces, o.strip_spans, 1, rgb, hist);
+	if (n == 0)
+		return o.brt;
+	o.brt = output_brightness(o, rgb, n, hist);
+	return o.brt;
+}
+
+/**
+ * Every pixel would go through the socket without MIT-SHM, so only
+ * the patches are fetched. They're all requested before the first
+ * reply is waited for, costing a single round trip. */
+int Xorg::patches_capture(Output &o)
+{
+	std::lock_guard lk(shm_mtx);
+	std::vector<xcb_get_image_cookie_t> ck(o.patches.size());
+	for (size_t i = 0; i < o.patches.size(); ++i) {
+		const Rect &r = o.patches[i].box;
+		ck[i] = xcb_get_image(xcb.conn, XCB_IMAGE_FORMAT_Z_PIXMAP, xcb.screen->root,
+		                      o.info->x + r.x, o.info->y + r.y, r.w, r.h, ~0);
+	}
+
+	uint64_t rgb[3] {};
+	uint32_t hist[hist_bins] {};
+	uint64_t n = 0;
+	for (size_t i = 0; i < o.patches.size(); ++i) {
+		auto rpl = xcb_get_image_reply(xcb.conn, ck[i], nullptr);
+		if (!rpl)
+			continue;
+		const Patch &p = o.patches[i];
+		n += spans_sum(o, xcb_get_image_data(rpl), pitch(p.box.w), p.box.x, p.box.y, p.spans, 1, rgb, hist);
+		free(rpl);
+	}
+	if (n == 0)
+		return o.brt;
+	o.brt = output_brightness(o, rgb, n, hist);
+	return o.brt;
 }
 
 int Xorg::get_screen_brightness(int scr_idx)
 {
 	Output *o = &outputs[scr_idx];
-	XShmGetImage(xlib.dsp, DefaultRootWindow(xlib.dsp), o->image, o->info->x, o->info->y, AllPlanes);
-	return calc_brightness(
-	    reinterpret_cast<uint8_t*>(o->image->data),
-	    o->image_len);
+	const auto &scr = cfg.screens[scr_idx];
+
+	if (o->kernels.luma != scr.brt_auto_luma || o->stat != scr.brt_auto_stat)
+		luma_set(*o, scr.brt_auto_luma, scr.brt_auto_stat);
+
+	// Unsupported pixel format, see root_format(), or all of it excluded
+	if (!o->kernels.sum || o->box.w == 0)
+		return o->brt;
+
+	const Capture_backend b = backend(scr_idx);
+
+	// Tiles are marked by event_loop()
+	if (has_damage) {
+		if (scr.brt_auto_damage && b == CAPTURE_SHM)
+			return tiles_update(*o);
+		if (scr.brt_auto_damage) {
+			std::lock_guard lk(damage_mtx);
+			if (!o->damaged)
+				return o->brt;
+			o->damaged = false;
+		}
+	}
+
+	if (b == CAPTURE_RENDER)
+		return render_capture(*o);
+	if (b == CAPTURE_STRIPS)
+		return strips_capture(*o, scr.brt_auto_strips, scr.brt_auto_strip_height);
+	if (b == CAPTURE_PATCHES)
+		return patches_capture(*o);
+
+	std::lock_guard lk(shm_mtx);
+
+	// A request sent before the last polling interval would give a stale frame
+	if (o->has_pending && std::chrono::steady_clock::now() - o->pending_since
+	    > std::chrono::milliseconds(scr.brt_auto_polling_rate) + o->capture_lead) {
+		shm_discard(*o);
+	}
+	if (!o->has_pending)
+		shm_request_next(*o);
+	if (!shm_collect(*o))
+		return o->brt;
+
+	if (o->sample_err != scr.brt_auto_sample_error) {
+		o->sample_err     = scr.brt_auto_sample_error;
+		o->sample_offsets = pieces_offsets(*o);
+		o->fingerprint = 0;
+	}
+	if (o->sample_offsets.empty())
+		return o->brt;
+
+	// Unchanged frames have the same brightness
+	const uint8_t *front = o->shm[o->shm_front].data();
+	const size_t n = o->sample_offsets.size();
+	const uint64_t fp = fingerprint(front, o->sample_offsets.data(), n,
+	                                std::max<size_t>(n / fingerprint_samples, 1),
+	                                o->kernels.bytes_per_pixel);
+	if (fp == o->fingerprint) {
+		++o->stats.fingerprint_hits;
+		return o->brt;
+	}
+	++o->stats.fingerprint_misses;
+	o->fingerprint = fp;
+
+	uint64_t rgb[3] {};
+	uint32_t hist[hist_bins] {};
+	if (o->stat == LUMA_MEAN)
+		o->kernels.sum_at(front, o->sample_offsets.data(), o->sample_offsets.size(), rgb);
+	else
+		o->kernels.hist_at(front, o->sample_offsets.data(), o->sample_offsets.size(), rgb, hist);
+	o->brt = output_brightness(*o, rgb, o->sample_offsets.size(), hist);
+	return o->brt;
 }
 
 void Xorg::set_gamma(int scr_idx, int brt_step, int temp_step)
@@ -134,35 +1380,113 @@ void Xorg::set_gamma(int scr_idx, int brt_step, int temp_step)
 
 void Xorg::apply_gamma_ramp(Output &o, int brt_step, int temp_step)
 {
+	const Ramp_cache::Ramp ramp = ramps.get(o.ramp_sz, brt_step, temp_step);
+	const uint16_t *r = &(*ramp)[0 * o.ramp_sz];
+	const uint16_t *g = &(*ramp)[1 * o.ramp_sz];
+	const uint16_t *b = &(*ramp)[2 * o.ramp_sz];
+
+	auto c = xcb_randr_set_crtc_gamma_checked(xcb.conn, o.crtc, o.ramp_sz, r, g, b);
+	xcb_generic_error_t *e = xcb_request_check(xcb.conn, c);
+	if (e) {
+		syslog(LOG_ERR, "randr set gamma error: %d", int(e->error_code));
+	}
+}
+
+Ramp_cache_stats Xorg::ramp_stats() const
+{
+	return ramps.stats();
+}
+
+Ramp_cache::Ramp_cache() : _stats{0, 0}
+{
+}
+
+Ramp_cache::Ramp Ramp_cache::get(int ramp_sz, int brt_step, int temp_step)
+{
+	brt_step  = std::clamp(brt_step, 0, brt_steps_max);
+	temp_step = std::clamp(temp_step, 0, temp_steps_max);
+	const uint64_t key = uint64_t(ramp_sz) << 32 | uint64_t(brt_step) << 16 | uint64_t(temp_step);
+
+	std::lock_guard lk(_mtx);
+
+	const auto it = _index.find(key);
+	if (it != _index.end()) {
+		++_stats.hits;
+		_lru.splice(_lru.begin(), _lru, it->second);
+		return it->second->second;
+	}
+	++_stats.misses;
+
 	/**
 	 * The ramp multiplier equals 32 when ramp_sz = 2048, 64 when 1024, etc.
 	 * Assuming ramp_sz = 2048 and pure state (default brightness/temp)
 	 * the RGB channels look like:
 	 * [ 0, 32, 64, 96, ... UINT16_MAX - 32 ]
 	 */
-	uint16_t *r = &o.ramps[0 * o.ramp_sz];
-	uint16_t *g = &o.ramps[1 * o.ramp_sz];
-	uint16_t *b = &o.ramps[2 * o.ramp_sz];
+	auto ramp = std::make_shared<std::vector<uint16_t>>(3 * size_t(ramp_sz));
+	uint16_t *r = &(*ramp)[0 * ramp_sz];
+	uint16_t *g = &(*ramp)[1 * ramp_sz];
+	uint16_t *b = &(*ramp)[2 * ramp_sz];
 
-	const double r_mult = step_to_kelvin(temp_step, 0),
-	             g_mult = step_to_kelvin(temp_step, 1),
-	             b_mult = step_to_kelvin(temp_step, 2);
+	const auto &mult = temp_step_table[temp_step];
 
-	const int    ramp_mult = (UINT16_MAX + 1) / o.ramp_sz;
+	const int    ramp_mult = (UINT16_MAX + 1) / ramp_sz;
 	const double brt_mult  = normalize(brt_step, 0, brt_steps_max) * ramp_mult;
 
-	for (int i = 0; i < o.ramp_sz; ++i) {
-		const int val = std::clamp(int(i * brt_mult), 0, UINT16_MAX);
-		r[i] = uint16_t(val * r_mult);
-		g[i] = uint16_t(val * g_mult);
-		b[i] = uint16_t(val * b_mult);
-	}
+	gamma_ramps(r, g, b, ramp_sz, brt_mult, mult.data());
 
-	auto c = xcb_randr_set_crtc_gamma_checked(xcb.conn, o.crtc, o.ramp_sz, r, g, b);
-	xcb_generic_error_t *e = xcb_request_check(xcb.conn, c);
-	if (e) {
-		syslog(LOG_ERR, "randr set gamma error: %d", int(e->error_code));
+	if (_lru.size() == ramp_cache_sz) {
+		_index.erase(_lru.back().first);
+		_lru.pop_back();
 	}
+	_lru.emplace_front(key, std::move(ramp));
+	_index[key] = _lru.begin();
+	return _lru.front().second;
+}
+
+Ramp_cache_stats Ramp_cache::stats() const
+{
+	std::lock_guard lk(_mtx);
+	return _stats;
+}
+
+void Xorg::idle_init()
+{
+	const xcb_query_extension_reply_t *ss_ext = xcb_get_extension_data(xcb.conn, &xcb_screensaver_id);
+	has_screensaver = ss_ext && ss_ext->present;
+	if (!has_screensaver)
+		syslog(LOG_WARNING, "MIT-SCREEN-SAVER not available, idle_timeout disabled");
+
+	const xcb_query_extension_reply_t *dpms_ext = xcb_get_extension_data(xcb.conn, &xcb_dpms_id);
+	has_dpms = dpms_ext && dpms_ext->present;
+}
+
+// Time since the last user input, or -1 if unknown
+int Xorg::idle_ms()
+{
+	if (!has_screensaver)
+		return -1;
+	auto ck  = xcb_screensaver_query_info(xcb.conn, xcb.screen->root);
+	auto rpl = xcb_screensaver_query_info_reply(xcb.conn, ck, nullptr);
+	if (!rpl)
+		return -1;
+	const int ret = int(rpl->ms_since_user_input);
+	free(rpl);
+	return ret;
+}
+
+// Whether DPMS has put the monitors in standby, suspend or off
+bool Xorg::display_off()
+{
+	if (!has_dpms)
+		return false;
+	auto ck  = xcb_dpms_info(xcb.conn);
+	auto rpl = xcb_dpms_info_reply(xcb.conn, ck, nullptr);
+	if (!rpl)
+		return false;
+	const bool ret = rpl->state && rpl->power_level != XCB_DPMS_DPMS_MODE_ON;
+	free(rpl);
+	return ret;
 }
 
 size_t Xorg::scr_count() const
@@ -21,21 +21,22 @@
 
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
-//#include <xcb/shm.h>
-//#include <xcb/xcb_image.h>
+#include <xcb/damage.h>
+#include <xcb/render.h>
+#include <xcb/shm.h>
+#include <xcb/screensaver.h>
+#include <xcb/dpms.h>
 
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/extensions/XShm.h>
+#include "cfg.h"
+#include "../common/utils.h"
 
 #include <vector>
-
-struct XLib
-{
-    XLib();
-	~XLib();
-	Display *dsp;
-};
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
 
 struct XCB
 {
@@ -46,15 +47,174 @@ struct XCB
 	int pref_screen;
 };
 
+/**
+ * Screenshot brightness is tracked per tile, so that
+ * damaged tiles can be fetched and summed on their own.
+ * Tiles read a jittered pixel in every tile_sample_step squared cell, see
+ * sample_spans(), and don't follow brt_auto_sample_error: a tile is
+ * fetched whole however few pixels are read from it, and from 1080p up,
+ * 1 in 64 pixels is more than full captures read at the default error of
+ * 2 levels. See tests/sampling.cpp for how close both get. */
+constexpr int tile_sz          = 64;
+constexpr int tile_sample_step = 8; // in both directions
+constexpr int tile_batch       = 16; // requests in flight at once
+
+/**
+ * Pixels hashed to tell whether a full frame or the strips changed,
+ * spread over what's sampled. A change covering 1% of it is missed
+ * 0.6% of the time. */
+constexpr size_t fingerprint_samples = 512;
+
+struct Capture_stats
+{
+	uint64_t fingerprint_hits;   // frames the reduction was skipped for
+	uint64_t fingerprint_misses;
+};
+
+/**
+ * Without MIT-SHM, CAPTURE_PATCHES fetches a grid of small squares
+ * spread over the region, a few KB per capture. */
+constexpr int patch_sz   = 8;
+constexpr int patch_cols = 8;
+constexpr int patch_rows = 4;
+
+struct Patch
+{
+	Rect box;                // fetched, bounding the spans
+	std::vector<Span> spans; // inside the region
+};
+
+// Size of the picture outputs are scaled down to by the RENDER backend
+constexpr int render_w = 64;
+constexpr int render_h = 36;
+
+/**
+ * Rectangle of the region fetched into a segment, at `offset` bytes, rows
+ * `pitch` bytes apart. Captures fetch the region as such rectangles, see
+ * Region::rects(), so excluded areas are never sent by the server. */
+struct Piece
+{
+	Rect r;
+	uint32_t offset;
+	int pitch;
+};
+
+struct Tile
+{
+	uint64_t rgb[3];
+	uint64_t samples;
+	uint32_t hist[hist_bins]; // unless the output uses the mean
+	bool dirty;
+	std::vector<Span> spans;   // sampled rows, inside the region
+	std::vector<Piece> pieces; // fetched, covering the spans
+};
+
+/**
+ * Shared memory segment the server writes captures into.
+ * Backed by a memfd passed to the server, so it's released as soon as
+ * both processes drop it, even after a crash. Servers without MIT-SHM 1.2
+ * get a SysV segment, removed as soon as the server has attached it. */
+class Shm
+{
+public:
+	Shm();
+	Shm(xcb_connection_t*, size_t len, bool fd_passing);
+	Shm(Shm&&);
+	Shm &operator=(Shm&&);
+	~Shm();
+	xcb_shm_seg_t seg() const;
+	uint8_t *data() const;
+	size_t len() const;
+private:
+	bool map_memfd(int flags);
+	void map_sysv();
+	void release();
+	xcb_connection_t *_conn;
+	xcb_shm_seg_t _seg;
+	uint8_t *_data;
+	size_t _len;
+	bool _sysv;
+};
+
+/**
+ * Gamma ramps are built once per (ramp size, brightness step, temperature
+ * step) and shared by the outputs with that ramp size, the least recently
+ * used being dropped past ramp_cache_sz. Animations going back and forth,
+ * and temperature transitions replayed every day, are served from it. */
+constexpr size_t ramp_cache_sz = 128; // about 1.5 MB of 2048 entry ramps
+
+struct Ramp_cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+};
+
+class Ramp_cache
+{
+public:
+	using Ramp = std::shared_ptr<const std::vector<uint16_t>>; // R, G, B
+
+	Ramp_cache();
+	Ramp get(int ramp_sz, int brt_step, int temp_step);
+	Ramp_cache_stats stats() const;
+private:
+	using Entry = std::pair<uint64_t, Ramp>;
+	std::list<Entry> _lru; // most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> _index;
+	Ramp_cache_stats _stats;
+	mutable std::mutex _mtx;
+};
+
+// Segments of at least this size get huge pages when possible
+constexpr size_t hugepage_sz = 2 * 1024 * 1024;
+
 struct Output
 {
-    std::vector<uint16_t> ramps;
 	xcb_randr_get_crtc_info_reply_t *info;
 	xcb_randr_crtc_t crtc;
-	XShmSegmentInfo shminfo;
-	XImage *image;
-	uint64_t image_len;
+	Shm shm[2];   // front and back frames, allocated on the first capture
+	int shm_front;
+	std::vector<xcb_shm_get_image_cookie_t> shm_pending; // a piece each, into the back frame
+	bool has_pending;
+	std::chrono::steady_clock::time_point pending_since;
+	std::chrono::microseconds capture_lead; // how early to request a frame
+	uint64_t image_len;        // of the pieces, segments may be larger
+	std::vector<Piece> pieces; // the region, as full captures fetch it
+	Shm tile_shm; // tile_batch tiles
+	Shm strip_shm;
+	std::vector<Piece> strip_pieces; // the region inside the strips
+	std::vector<Span> strip_spans;
+	uint64_t strip_len;
+	int strips;   // the strip pieces were compiled for, 0 if outdated
+	int strip_h;
+	std::vector<uint32_t> sample_offsets; // into shm, see sample_offsets()
+	double sample_err;                    // they were built for
+	uint64_t fingerprint; // of the last reduced frame, see fingerprint()
+	Capture_stats stats;
+	std::chrono::steady_clock::time_point shm_used;
+	size_t tile_len; // of the largest tile's pieces
+	std::vector<Tile> tiles;
+	int tile_cols;
+	int tile_rows;
+	int dirty_tiles; // marked from XDamage events
+	uint64_t rgb[3]; // sums of all tiles
+	uint64_t samples;
+	uint32_t hist[hist_bins];
+	Luma_stat stat;  // the tiles were summed for
+	xcb_pixmap_t render_pixmap;
+	xcb_render_picture_t render_src; // root window, scaled to render_w x render_h
+	xcb_render_picture_t render_dst;
+	Rgb_kernels kernels; // for the root window's pixel format
+	Region cfg_region;   // as set, before the focused window is applied
+	bool active_only;    // measure the focused window only, see region_apply()
+	Region region;
+	Rect box;            // bounding the region
+	std::vector<Span> render_spans; // region in the RENDER picture
+	std::vector<Rect> render_rects; // composited
+	std::vector<Patch> patches;
 	int ramp_sz;
+	int brt;         // last captured brightness
+	bool damaged;    // since the last RENDER capture
 };
 
 class Xorg
@@ -64,11 +224,78 @@ public:
 	int    get_screen_brightness(int scr_idx);
 	void   set_gamma(int scr_idx, int brt, int temp);
 	size_t scr_count() const;
+	void   release_idle_buffers();
+	void   set_region(int scr_idx, const Region &);
+	void   set_active_only(int scr_idx, bool);
+	void   capture_request(int scr_idx);
+	void   flush();
+	std::chrono::microseconds capture_lead(int scr_idx) const;
+	Capture_stats stats(int scr_idx) const;
+	Ramp_cache_stats ramp_stats() const;
+	Rect   area(int scr_idx) const;
+	int    idle_ms();
+	bool   display_off();
+	void   event_loop(const std::function<void(int scr_idx)> &on_switch);
+	void   events_stop();
 private:
 	void apply_gamma_ramp(Output &, int brt_step, int temp_step);
+	void damage_init();
+	void damage_mark(const xcb_damage_notify_event_t *);
+	void events_init();
+	void switched(int scr_idx, const std::function<void(int)> &on_switch);
+	void active_set(xcb_window_t, bool focused, const std::function<void(int)> &on_switch);
+	xcb_window_t active_window();
+	Rect window_rect(xcb_window_t);
+	bool region_apply(Output &);
+	int  tiles_update(Output &);
+	void render_init();
+	void idle_init();
+	int  render_capture(Output &);
+	int  strips_capture(Output &, int strips, int strip_h);
+	int  patches_capture(Output &);
+	bool shm_probe();
+	Pixel_format root_format();
+	void luma_set(Output &, Luma_mode, Luma_stat);
+	int  pitch(int w) const;
+	void region_compile(Output &);
+	void tiles_reset(Output &);
+	uint64_t spans_sum(const Output &, const uint8_t *img, int pitch, int ox, int oy, const std::vector<Span> &, int step, uint64_t rgb[3], uint32_t hist[hist_bins]);
+	uint64_t pieces_sum(const Output &, const uint8_t *img, const std::vector<Piece> &, const std::vector<Span> &, int step, uint64_t rgb[3], uint32_t hist[hist_bins]);
+	uint64_t pieces_layout(std::vector<Piece> &, const std::vector<Rect> &) const;
+	std::vector<uint32_t> pieces_offsets(const Output &);
+	void strips_compile(Output &, int strips, int strip_h);
+	void tile_sum(Output &, Tile &, const uint8_t *img, const std::vector<Piece> &);
+	void shm_alloc(Output &, Shm &, size_t len);
+	void shm_request_next(Output &);
+	bool shm_collect(Output &);
+	Capture_backend backend(int scr_idx) const;
+	bool pipelined(int scr_idx) const;
+	xcb_shm_get_image_cookie_t shm_request(const Output &, const Shm &, uint32_t offset, int x, int y, int w, int h);
+	void shm_request(const Output &, const Shm &, uint32_t offset, const std::vector<Piece> &, std::vector<xcb_shm_get_image_cookie_t> &);
+	void shm_discard(Output &);
+	bool shm_reply(xcb_shm_get_image_cookie_t);
+	bool shm_reply(const std::vector<xcb_shm_get_image_cookie_t> &);
+	XCB  xcb; // destroyed last
 	std::vector<Output> outputs;
-	XLib xlib;
-	XCB  xcb;
+	Ramp_cache ramps;
+	bool has_shm;
+	bool shm_fd_passing;
+	Pixel_format format;
+	int scanline_pad; // in bits
+	std::mutex damage_mtx;
+	std::mutex shm_mtx;
+	xcb_damage_damage_t damage;
+	uint8_t damage_ev_base;
+	bool has_damage;
+	bool has_render;
+	bool has_screensaver;
+	bool has_dpms;
+	xcb_window_t event_win;
+	xcb_atom_t atom_active_window;
+	xcb_atom_t atom_current_desktop;
+	xcb_atom_t atom_quit;
+	xcb_window_t active_win; // focused window, selected for ConfigureNotify
+	Rect active_rect;        // its root coordinates, updated when configured
 };
 
 #endif // XCB_H
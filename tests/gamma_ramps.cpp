@@ -0,0 +1,90 @@
+/**
+* gummy
+* Copyright (C) 2022  Francesco Fusco
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../src/common/defs.h"
+#include "../src/common/utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * Checks the fixed point ramps against the floating point computation they
+ * replaced, over every brightness and temperature step: at most one LSB
+ * apart, and the same whatever the kernel. */
+int main()
+{
+	const Ramp_kernel kernels[] { RAMP_SCALAR, RAMP_SSE2, RAMP_AVX2 };
+	const char *names[] { "scalar", "sse2", "avx2" };
+
+	int worst = 0;
+	uint64_t entries = 0;
+	uint64_t off = 0;
+	int failures = 0;
+
+	for (int ramp_sz : { 256, 1000, 1024, 2048 }) {
+		const int ramp_mult = (UINT16_MAX + 1) / ramp_sz;
+		std::vector<uint16_t> ref(3 * size_t(ramp_sz));
+		std::vector<uint16_t> out[3];
+
+		for (int brt = 0; brt <= brt_steps_max; ++brt) {
+			const double brt_mult = normalize(brt, 0, brt_steps_max) * ramp_mult;
+			for (int temp = 0; temp <= temp_steps_max; ++temp) {
+				const auto &mult = temp_step_table[temp];
+
+				for (int i = 0; i < ramp_sz; ++i) {
+					const int val = std::clamp(int(i * brt_mult), 0, UINT16_MAX);
+					for (int c = 0; c < 3; ++c)
+						ref[c * ramp_sz + i] = uint16_t(val * mult[c]);
+				}
+
+				for (int k = 0; k < 3; ++k) {
+					out[k].assign(3 * size_t(ramp_sz), 0);
+					uint16_t *o = out[k].data();
+					if (!gamma_ramps(o, o + ramp_sz, o + 2 * ramp_sz, ramp_sz, brt_mult, mult.data(), kernels[k]))
+						out[k].clear();
+				}
+
+				for (int k = 1; k < 3; ++k) {
+					if (!out[k].empty() && out[k] != out[0] && failures++ < 10)
+						printf("%s differs from scalar: ramp_sz %d brt %d temp %d\n", names[k], ramp_sz, brt, temp);
+				}
+
+				for (size_t i = 0; i < ref.size(); ++i) {
+					const int d = std::abs(int(out[0][i]) - int(ref[i]));
+					if (d > 1 && failures++ < 10)
+						printf("off by %d: ramp_sz %d brt %d temp %d entry %zu\n", d, ramp_sz, brt, temp, i);
+					worst = std::max(worst, d);
+					off += d != 0;
+				}
+				entries += ref.size();
+			}
+		}
+	}
+
+	for (int k = 1; k < 3; ++k) {
+		std::vector<uint16_t> r(1);
+		const double mult[3] { 1, 1, 1 };
+		if (!gamma_ramps(r.data(), r.data(), r.data(), 1, 1, mult, kernels[k]))
+			printf("%s not supported, skipped\n", names[k]);
+	}
+	printf("max difference %d LSB, %.2f%% of %llu channel entries differ\n",
+	       worst, 100. * off / entries, (unsigned long long)entries);
+	return failures > 0;
+}
@@ -0,0 +1,128 @@
+/**
+* gummy
+* Copyright (C) 2022  Francesco Fusco
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../src/common/utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+/**
+ * Accuracy of the sampled brightness against the exact mean of 3840x2160
+ * BGRX frames: the old 1024 pixel stride, a fixed grid of a pixel in every
+ * 8x8 cell, the jittered one damage tiles read (sample_spans()), and the
+ * stratified offsets of full captures at several values of
+ * brt_auto_sample_error. The worst error over 50 seeds of the offsets has
+ * to stay within the error they were built for, and the tiles within one
+ * level. */
+constexpr int w = 3840;
+constexpr int h = 2160;
+constexpr int bpp = 4;
+constexpr int seeds = 50;
+
+static double luma(const uint64_t rgb[3], uint64_t n)
+{
+	return (rgb[0] * 0.2126 + rgb[1] * 0.7152 + rgb[2] * 0.0722) / n;
+}
+
+static double mean_at(const Rgb_kernels &k, const std::vector<uint8_t> &img, const std::vector<uint32_t> &offsets)
+{
+	uint64_t rgb[3] {};
+	k.sum_at(img.data(), offsets.data(), offsets.size(), rgb);
+	return luma(rgb, offsets.size());
+}
+
+int main()
+{
+	const Rgb_kernels k = rgb_kernels({ bpp, { 0x00ff0000, 0x0000ff00, 0x000000ff }, false });
+
+	struct Scene
+	{
+		const char *name;
+		std::function<uint8_t(int x, int y)> px; // gray level
+	};
+	uint32_t noise = 1;
+	const Scene scenes[] {
+		{ "1px lines every 64px", [] (int x, int) { return uint8_t(x % 64 == 0 ? 255 : 20); } },
+		{ "top panel, dark noise", [&noise] (int, int y) {
+			noise = noise * 1664525 + 1013904223;
+			return uint8_t(y < 40 ? 230 : (noise >> 24) % 48);
+		} },
+		{ "smooth gradient", [] (int x, int) { return uint8_t(x * 256 / w); } },
+	};
+
+	std::vector<uint32_t> grid;
+	for (int y = 0; y < h; y += 8)
+		for (int x = 0; x < w; x += 8)
+			grid.push_back(uint32_t(y) * w * bpp + uint32_t(x) * bpp);
+
+	// Damage tiles, see Xorg::region_compile()
+	std::vector<uint32_t> tiles;
+	const int cols = (w + 63) / 64;
+	const int rows = (h + 63) / 64;
+	for (int i = 0; i < cols * rows; ++i) {
+		const int x = i % cols * 64;
+		const int y = i / cols * 64;
+		for (const Span &s : sample_spans({ x, y, std::min(64, w - x), std::min(64, h - y) }, 8, uint32_t(i) + 1, Region()))
+			for (int x = s.x0; x < s.x1; x += 8)
+				tiles.push_back(uint32_t(s.y) * w * bpp + uint32_t(x) * bpp);
+	}
+
+	const double errs[] { 1, 2, 4, 8 };
+	int failures = 0;
+
+	for (const Scene &s : scenes) {
+		std::vector<uint8_t> img(size_t(w) * h * bpp);
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				uint8_t *p = &img[(size_t(y) * w + x) * bpp];
+				p[0] = p[1] = p[2] = s.px(x, y);
+				p[3] = 0;
+			}
+		}
+
+		uint64_t rgb[3] {};
+		k.sum(img.data(), img.size(), bpp, rgb);
+		const double exact = luma(rgb, uint64_t(w) * h);
+
+		uint64_t rgb_stride[3] {};
+		k.sum(img.data(), img.size(), 1024 * bpp, rgb_stride);
+		const double stride = luma(rgb_stride, (img.size() - bpp) / (1024 * bpp) + 1);
+		const double tiles_err = std::abs(mean_at(k, img, tiles) - exact);
+
+		printf("%-22s exact %6.2f  stride 1024: %6.2f  8x8 grid: %6.2f  tiles: %.2f\n",
+		       s.name, exact, std::abs(stride - exact), std::abs(mean_at(k, img, grid) - exact), tiles_err);
+		failures += tiles_err > 1;
+
+		printf("  stratified, worst of %d seeds:", seeds);
+		for (double err : errs) {
+			double worst = 0;
+			for (int seed = 1; seed <= seeds; ++seed) {
+				const auto offsets = sample_offsets({ 0, 0, w, h }, w * bpp, bpp, samples_for_error(err), uint32_t(seed), Region());
+				worst = std::max(worst, std::abs(mean_at(k, img, offsets) - exact));
+			}
+			printf("  err %g: %.2f", err, worst);
+			failures += worst > err;
+		}
+		printf("\n");
+	}
+
+	return failures > 0;
+}